@@ -1,6 +1,9 @@
 #include "beatgen.h"
+#include "beatrenderer.h"
+#include "euclidtable.h"
+#include "patterncache.h"
 
-typedef std::vector<bool>   BoolVector;
+static_assert(BeatGen::maxClockRate <= BeatGen::maxSteps, "Step kernel is too small for the step parameters");
 
 #define PARAM_PREFIX    "beatgen"
 
@@ -86,19 +89,27 @@ static int stringToMidiNote(const juce::String &val) {
     return note;
 }
 
-BoolVector generateEuclidBeat(int count, int total, int off = 0) {
-        BoolVector ret;
-        ret.assign(total, false);
-        int bucket = 0;
+static_assert(BeatGen::maxClockRate <= EuclidTable::maxSteps, "Euclid table is too small for the step parameters");
+
+// Looks up the euclid pattern and rotates it into place.  The bucket loop is
+// only used for step counts past the end of the table.
+static void generateEuclidBeat(BeatGen::StepBits &ret, EuclidTable::Distribution dist, int count, int total, int off = 0) {
         int offset = off + 1;
+        if(total <= EuclidTable::maxSteps && count >= 0 && count <= total) {
+                const EuclidTable::Entry &entry = EuclidTable::pattern(dist, count, total);
+                ret.rotate(entry.bits, total, ((offset % total) + total) % total);
+                return;
+        }
+        ret.clear(total);
+        int bucket = 0;
         for(int x = 0; x < total; x++) {
                 bucket += count;
                 if(bucket >= total) {
                         bucket -= total;
-                        ret[(x + offset) % total] = true;
+                        ret.set((x + offset) % total);
                 }
         }
-        return ret;
+        return;
 }
 
 const juce::StringArray &BeatGen::mixModeNames() {
@@ -119,227 +130,278 @@ const juce::StringArray &BeatGen::mixModeNames() {
     return _mixModeNames;
 }
 
-BoolVector mixBeats(const BoolVector &b1, const BoolVector &b2, int mode) {
-        BoolVector ret;
-        size_t total = b1.size();
-        if(b2.size() != total) return ret;
-        ret.assign(total, false);
-        for(int x = 0; x < total; x++) {
-                bool v1 = b1[x];
-                bool v2 = b2[x];
-                bool v = false;
-                switch(mode) {
-                        default:
-                        case 0:  v = v1 && v2; break;
-                        case 1:  v = v1 || v2; break;
-                        case 2:  v = v1 != v2; break;
-                        case 3:  v = !(v1 && v2); break;
-                        case 4:  v = !(v1 || v2); break;
-                        case 5:  v = !(v1 != v2); break;
-                        case 6:  v = !v1 && v2; break;
-                        case 7:  v = !v1 || v2; break;
-                        case 8:  v = !v1 != v2; break;
-                        case 9:  v = v1 && !v2; break;
-                        case 10: v = v1 || !v2; break;
-                        case 11: v = v1 != !v2; break;
-                }
-                ret[x] = v;
-        }
-        return ret;
+const juce::StringArray &BeatGen::gateModeNames() {
+    // The order here must match GateMode
+    static juce::StringArray _gateModeNames = {
+        /*  0 */ "Legato",
+        /*  1 */ "Steps",
+        /*  2 */ "Time"
+    };
+    return _gateModeNames;
 }
 
-BeatGen::BeatGen(int idx) :
-    _index(idx) 
-{
-    // Clang apparently doesn't like static constexpr variables.
-    // It'll compile but fail to link.  Lame.
-    int __maxBars = maxBars;
-    int __maxClockRate = maxClockRate;
-
-    _enabled.setup(
-        _params, 
-        juce::String::formatted(PARAM_PREFIX "%d_enabled", _index),
-        juce::String::formatted("G%d Enabled", _index + 1), 
-        [](const ParamValue &p) {
+const juce::StringArray &BeatGen::distributionNames() {
+    // The order here must match EuclidTable::Distribution
+    static juce::StringArray _distributionNames = {
+        /*  0 */ "Bresenham",
+        /*  1 */ "Bjorklund"
+    };
+    return _distributionNames;
+}
+
+// The logic for each of the mix modes, applied a whole word of steps at a time.
+// The order here must match mixModeNames().
+template <int Mode> struct MixOp;
+template <> struct MixOp<0>  { static uint64_t apply(uint64_t a, uint64_t b) { return a & b; } };
+template <> struct MixOp<1>  { static uint64_t apply(uint64_t a, uint64_t b) { return a | b; } };
+template <> struct MixOp<2>  { static uint64_t apply(uint64_t a, uint64_t b) { return a ^ b; } };
+template <> struct MixOp<3>  { static uint64_t apply(uint64_t a, uint64_t b) { return ~(a & b); } };
+template <> struct MixOp<4>  { static uint64_t apply(uint64_t a, uint64_t b) { return ~(a | b); } };
+template <> struct MixOp<5>  { static uint64_t apply(uint64_t a, uint64_t b) { return ~(a ^ b); } };
+template <> struct MixOp<6>  { static uint64_t apply(uint64_t a, uint64_t b) { return ~a & b; } };
+template <> struct MixOp<7>  { static uint64_t apply(uint64_t a, uint64_t b) { return ~a | b; } };
+template <> struct MixOp<8>  { static uint64_t apply(uint64_t a, uint64_t b) { return ~a ^ b; } };
+template <> struct MixOp<9>  { static uint64_t apply(uint64_t a, uint64_t b) { return a & ~b; } };
+template <> struct MixOp<10> { static uint64_t apply(uint64_t a, uint64_t b) { return a | ~b; } };
+template <> struct MixOp<11> { static uint64_t apply(uint64_t a, uint64_t b) { return a ^ ~b; } };
+
+// Mixes the clock into the input.  There's one of these per mix mode, so the
+// loop has no branches in it and the compiler is free to vectorize it.
+template <int Mode>
+static void mixKernel(BeatGen::StepBits &in, const BeatGen::StepBits &clock, int steps) {
+        typedef BeatGen::StepBits::Word Word;
+        const int count = BeatGen::StepBits::wordCount(steps);
+        Word *a = in.words();
+        const Word *b = clock.words();
+        for(int x = 0; x < count; x++) a[x] = MixOp<Mode>::apply(a[x], b[x]);
+        // Any of the inverting modes will have set the unused bits in the last word.
+        if(MixOp<Mode>::apply(0, 0) != 0 || MixOp<Mode>::apply(0, ~(Word)0) != 0) in.maskTail(steps);
+        return;
+}
+
+static const BeatGen::MixKernel mixKernels[] = {
+        mixKernel<0>, mixKernel<1>, mixKernel<2>,  mixKernel<3>,
+        mixKernel<4>, mixKernel<5>, mixKernel<6>,  mixKernel<7>,
+        mixKernel<8>, mixKernel<9>, mixKernel<10>, mixKernel<11>
+};
+static const int mixKernelCount = sizeof(mixKernels) / sizeof(mixKernels[0]);
+
+// Returns the kernel for the given mix mode.
+static BeatGen::MixKernel mixKernelForMode(int mode) {
+        if(mode < 0 || mode >= mixKernelCount) mode = 0;
+        return mixKernels[mode];
+}
+
+// The host sees the parameters in slot order: the generator's own parameters,
+// then each clock's parameters in turn.  So the generator rows come first
+// here, then the rows that repeat for every clock.
+constexpr BeatGen::ParamInfo BeatGen::paramInfo[] = {
+    { ParamEnabled, false, "enabled", "Enabled",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
             return std::make_unique<juce::AudioParameterBool>(p.id(), p.name(), false);
-        },
-        ParamEnabled
-    );
-    
-    _solo.setup(
-        _params, 
-        juce::String::formatted(PARAM_PREFIX "%d_solo", _index),
-        juce::String::formatted("G%d Solo", _index + 1), 
-        [](const ParamValue &p) {
+        }
+    },
+    { ParamSolo, false, "solo", "Solo",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
             return std::make_unique<juce::AudioParameterBool>(p.id(), p.name(), false);
-        },
-        ParamSolo
-    );
-
-    _note.setup(
-        _params,
-        juce::String::formatted(PARAM_PREFIX "%d_note", _index),
-        juce::String::formatted("G%d Note", _index + 1),
-        [this](const ParamValue &p) {
+        }
+    },
+    { ParamNote, false, "note", "Note",
+        [](const BeatGen &gen, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
             return std::make_unique<juce::AudioParameterInt>(
                 p.id(), p.name(),
-                0, 127, (firstNote + _index) % 128,
+                0, 127, (firstNote + gen._index) % 128,
                 juce::String(),
                 &midiNoteToString,
                 &stringToMidiNote
             );
-        },
-        ParamNote
-    );
-    
-    _level.setup(
-        _params,
-        juce::String::formatted(PARAM_PREFIX "%d_level", _index),
-        juce::String::formatted("G%d Level", _index + 1),
-        [](const ParamValue &p) {
-                return std::make_unique<juce::AudioParameterFloat>(
-                    p.id(), p.name(),
-                    -1.0f, 1.0f, 1.0f
-                );
-        },
-        ParamLevel
-    );
-
-    _steps.setup(
-        _params,
-        juce::String::formatted(PARAM_PREFIX "%d_steps", _index),
-        juce::String::formatted("G%d Steps", _index + 1),
-        [__maxClockRate](const ParamValue &p) {
+        }
+    },
+    { ParamLevel, false, "level", "Level",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                -1.0f, 1.0f, 1.0f
+            );
+        }
+    },
+    { ParamSteps, false, "steps", "Steps",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            // Clang apparently doesn't like static constexpr variables.
+            // It'll compile but fail to link.  Lame.
+            int __maxClockRate = maxClockRate;
             return std::make_unique<juce::AudioParameterInt>(
-                p.id(), p.name(), 
+                p.id(), p.name(),
                 1, __maxClockRate, 16,
                 juce::String()
             );
-        },
-        ParamSteps
-    );
-    
-    _phaseOffset.setup(
-        _params,
-        juce::String::formatted(PARAM_PREFIX "%d_phase_offset", _index),
-        juce::String::formatted("G%d Phase Offset", _index + 1),
-        [](const ParamValue &p) {
-                return std::make_unique<juce::AudioParameterFloat>(
-                    p.id(), p.name(),
-                    0.0f, 1.0f, 0.0f
-                );
-        },
-        ParamPhaseOffset
-    );
-    
-    _bars.setup(
-        _params,
-        juce::String::formatted(PARAM_PREFIX "%d_bars", _index),
-        juce::String::formatted("G%d Bars", _index + 1),
-        [__maxBars](const ParamValue &p) {
+        }
+    },
+    { ParamPhaseOffset, false, "phase_offset", "Phase Offset",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                0.0f, 1.0f, 0.0f
+            );
+        }
+    },
+    { ParamBars, false, "bars", "Bars",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            int __maxBars = maxBars;
             return std::make_unique<juce::AudioParameterInt>(
                 p.id(), p.name(),
                 1, __maxBars, 1,
                 juce::String()
             );
-        },
-        ParamBars
-    );
+        }
+    },
+    { ParamSwing, false, "swing", "Swing",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                -1.0f, 1.0f, 0.0f
+            );
+        }
+    },
+    { ParamGateMode, false, "gate_mode", "Gate Mode",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterChoice>(
+                p.id(), p.name(),
+                gateModeNames(), GateLegato
+            );
+        }
+    },
+    { ParamGateLength, false, "gate_length", "Gate Length",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                0.0f, 1.0f, 0.5f
+            );
+        }
+    },
+    { ParamGateTime, false, "gate_time", "Gate Time",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                juce::NormalisableRange<float>(1.0f, 2000.0f, 1.0f, 0.3f), 100.0f
+            );
+        }
+    },
 
-    _swing.setup(
-        _params,
-        juce::String::formatted(PARAM_PREFIX "%d_swing", _index),
-        juce::String::formatted("G%d Swing", _index + 1),
-        [](const ParamValue &p) {
-                return std::make_unique<juce::AudioParameterFloat>(
-                    p.id(), p.name(),
-                    -1.0f, 1.0f, 0.0f
-                );
-        },
-        ParamSwing
-    );
-    
-    for(int i = 0; i < maxClockCount; i++) {
-        _clockEnabled[i].setup(
-            _params,
-            juce::String::formatted(PARAM_PREFIX "%d_clock%d_enabled", _index, i),
-            juce::String::formatted("G%d Clock %d Euclid Enable", _index + 1, i + 1),
-            [](const ParamValue &p) {
-                return std::make_unique<juce::AudioParameterBool>(
-                    p.id(), p.name(),
-                    p.index() == 0, // Only the first clock should be enabled by default
-                    juce::String()
-                );
-            },
-            ParamClockEnabled,
-            i
-        );
-        
-        _clockLevel[i].setup(
-            _params,
-            juce::String::formatted(PARAM_PREFIX "%d_clock%d_level", _index, i),
-            juce::String::formatted("G%d Clock %d Level", _index + 1, i + 1),
-            [](const ParamValue &p) {
-                    return std::make_unique<juce::AudioParameterFloat>(
-                        p.id(), p.name(),
-                        -1.0f, 1.0f, 0.0f
-                    );
-            },
-            ParamClockLevel,
-            i
-        );
-
-        _clockRate[i].setup(
-            _params,
-            juce::String::formatted(PARAM_PREFIX "%d_clock%d_rate", _index, i),
-            juce::String::formatted("G%d Clock %d Rate", _index + 1, i + 1),
-            [this](const ParamValue &p) {
-                return std::make_unique<juce::AudioParameterFloat>(
-                    p.id(), p.name(),
-                    juce::NormalisableRange<float>(0.0f, 1.0f), 0.0f,
-                    p.name(),
-                    juce::AudioProcessorParameter::genericParameter,
-                    [this](float value, int maxLen) {
-                        juce::ignoreUnused(maxLen); // FIXME?  Chop the returned string?
-                        return juce::String(this->clockRateFloatToInt(value));
-                    },
-                    [this](const juce::String &str) {
-                        return this->clockRateIntToFloat(str.getIntValue());
-                    }
-                );
-            },
-            ParamClockRate,
-            i
-        );
-
-        _clockPhaseOffset[i].setup(
-            _params,
-            juce::String::formatted(PARAM_PREFIX "%d_clock%d_phase_offset", _index, i),
-            juce::String::formatted("G%d Clock %d Phase Offset", _index + 1, i + 1),
-            [](const ParamValue &p) {
-                return std::make_unique<juce::AudioParameterFloat>(
-                    p.id(), p.name(),
-                    0.0f, 1.0f, 0.0f
-                );
-            },
-            ParamClockPhaseOffset,
-            i
-        );
-
-        _clockMixMode[i].setup(
-            _params,
-            juce::String::formatted(PARAM_PREFIX "%d_clock%d_mix_mode", _index, i),
-            juce::String::formatted("G%d Clock %d Mix Mode", _index + 1, i + 1),
-            [](const ParamValue &p) {
-                return std::make_unique<juce::AudioParameterChoice>(
-                    p.id(), p.name(), 
-                    mixModeNames(), 0
-                );
-            },
-            ParamClockMixMode,
-            i
-        );
+    { ParamClockEnabled, true, "enabled", "Euclid Enable",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterBool>(
+                p.id(), p.name(),
+                p.index() == 0, // Only the first clock should be enabled by default
+                juce::String()
+            );
+        }
+    },
+    { ParamClockLevel, true, "level", "Level",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                -1.0f, 1.0f, 0.0f
+            );
+        }
+    },
+    { ParamClockRate, true, "rate", "Rate",
+        [](const BeatGen &gen, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            const ParamValue &steps = gen.param(ParamSteps);
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                juce::NormalisableRange<float>(0.0f, 1.0f), 0.0f,
+                p.name(),
+                juce::AudioProcessorParameter::genericParameter,
+                [&steps](float value, int maxLen) {
+                    juce::ignoreUnused(maxLen); // FIXME?  Chop the returned string?
+                    return juce::String(clockRateFloatToInt(value, steps.valueInt()));
+                },
+                [&steps](const juce::String &str) {
+                    return clockRateIntToFloat(str.getIntValue(), steps.valueInt());
+                }
+            );
+        }
+    },
+    { ParamClockPhaseOffset, true, "phase_offset", "Phase Offset",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterFloat>(
+                p.id(), p.name(),
+                0.0f, 1.0f, 0.0f
+            );
+        }
+    },
+    { ParamClockMixMode, true, "mix_mode", "Mix Mode",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterChoice>(
+                p.id(), p.name(),
+                mixModeNames(), 0
+            );
+        }
+    },
+    { ParamClockDistribution, true, "distribution", "Distribution",
+        [](const BeatGen &, const ParamValue &p) -> ParamValue::RangedAudioParamUniq {
+            return std::make_unique<juce::AudioParameterChoice>(
+                p.id(), p.name(),
+                distributionNames(), 0
+            );
+        }
+    }
+};
+
+// Row of paramInfo and clock index for each slot.
+constexpr int BeatGen::paramRow(int slot) {
+    return slot < globalParamCount ? slot : globalParamCount + (slot - globalParamCount) % clockParamCount;
+}
+
+constexpr int BeatGen::paramClock(int slot) {
+    return slot < globalParamCount ? 0 : (slot - globalParamCount) / clockParamCount;
+}
 
+constexpr BeatGen::ParamSlots BeatGen::makeParamSlots() {
+    ParamSlots ret {};
+    for(int id = 0; id <= maxParamID; id++) {
+        for(int i = 0; i < maxClockCount; i++) ret.slot[id][i] = -1;
+    }
+    for(int slot = 0; slot < paramCount; slot++) {
+        ret.slot[paramInfo[paramRow(slot)].id][paramClock(slot)] = slot;
+    }
+    return ret;
+}
+
+constexpr BeatGen::ParamSlots BeatGen::paramSlots = BeatGen::makeParamSlots();
+
+BeatGen::BeatGen(int idx, BeatRenderer &renderer) :
+    _index(idx),
+    _renderer(renderer)
+{
+    static_assert(sizeof(paramInfo) / sizeof(paramInfo[0]) == globalParamCount + clockParamCount, "Parameter table doesn't match the counts");
+    static_assert(paramInfo[globalParamCount - 1].perClock == false && paramInfo[globalParamCount].perClock == true, "Clock parameters have to come last");
+
+    juce::String idPrefix = PARAM_PREFIX + juce::String(_index) + "_";
+    juce::String namePrefix = "G" + juce::String(_index + 1) + " ";
+    for(int slot = 0; slot < paramCount; slot++) {
+        const ParamInfo &info = paramInfo[paramRow(slot)];
+        int clock = paramClock(slot);
+        juce::String id = idPrefix;
+        juce::String name = namePrefix;
+        if(info.perClock) {
+            id += "clock" + juce::String(clock) + "_";
+            name += "Clock " + juce::String(clock + 1) + " ";
+        }
+        id += info.key;
+        name += info.name;
+        _paramValues[slot].setup(id, name, info.id, clock);
+        _paramSlotsByID.set(id, slot + 1);
+    }
+
+    for(auto &i : _modAmount) i.store(0.0f);
+}
+
+BeatGen::RenderScratch::RenderScratch() {
+    for(int i = 0; i < maxClockCount; i++) {
+        mixMode[i] = -1;
+        mixKernel[i] = nullptr;
     }
 }
 
@@ -349,37 +411,186 @@ BeatGen::~BeatGen() {
 
 // Converts between the floating point 0.0 .. 1.0 value of the clockRate parameter
 // and the actual clock rate value (which is an integer).  The 0.0 .. 1.0 value
-// maps to the range 1 .. BeatGen Steps.
-int BeatGen::clockRateFloatToInt(float val) const {
-    juce::NormalisableRange<float> range(1, _steps.value(), 1.0);
-    return (int)range.convertFrom0to1(val);
+// maps to the range 1 .. BeatGen Steps.  This is the same mapping as a
+// NormalisableRange(1, steps, 1) without having to build one.
+int BeatGen::clockRateFloatToInt(float val, int steps) {
+    return (int)(1.0f + (float)(steps - 1) * val);
 }
 
-float BeatGen::clockRateIntToFloat(int val) const {
-    juce::NormalisableRange<float> range(1, _steps.value(), 1.0);
-    return range.convertTo0to1((float)val);
+float BeatGen::clockRateIntToFloat(int val, int steps) {
+    if(steps <= 1) return 0.0f;
+    return juce::jlimit(0.0f, 1.0f, (float)(val - 1) / (float)(steps - 1));
 }
 
 const ParamValue *BeatGen::getParameter(int id, int index) const {
-    ParamValue *ret = nullptr;
-    for(auto i : _params) {
-        if(i->moduleID() == id && i->index() == index) {
-            ret = i;
-            break;
-        }
+    if(id < 0 || id > maxParamID || index < 0 || index >= maxClockCount) return nullptr;
+    int slot = paramSlots.slot[id][index];
+    return slot >= 0 ? &_paramValues[slot] : nullptr;
+}
+
+// Returns the render stages that a change to the given parameter makes dirty.
+int BeatGen::renderStagesForParam(int id) {
+    switch(id) {
+        // These are all applied by generate(), so they never need a render.
+        case ParamEnabled:
+        case ParamSolo:
+        case ParamNote:
+        case ParamPhaseOffset:
+        case ParamGateMode:
+        case ParamGateLength:
+        case ParamGateTime:
+            return 0;
+
+        case ParamSteps:
+            return StageAll;
+
+        // The velocity is sampled at the swung start time, so it has to follow the timing.
+        case ParamBars:
+        case ParamSwing:
+            return StageTiming | StageVelocity;
+
+        case ParamLevel:
+        case ParamClockLevel:
+            return StageVelocity;
+
+        // Rate and phase offset also shape each clock's velocity sawtooth.
+        case ParamClockEnabled:
+        case ParamClockRate:
+        case ParamClockPhaseOffset:
+        case ParamClockMixMode:
+        case ParamClockDistribution:
+            return StageClocks | StageVelocity;
     }
-    return ret;
+    return StageAll;
 }
 
 void BeatGen::parameterChanged(const juce::String &parameterID, float newValue) {
-    if(parameterID == getParameter(ParamSteps)->id()) {
+    juce::ignoreUnused(newValue);
+    // The map holds slot + 1, so IDs it doesn't have come back as -1.
+    int slot = _paramSlotsByID[parameterID] - 1;
+    int id = slot >= 0 ? _paramValues[slot].moduleID() : 0;
+    if(id == ParamSteps) {
         for(int i = 0; i < maxClockCount; i++) {
-            const ParamValue *pv = getParameter(ParamClockRate, i);
-            if(pv != NULL) pv->notifyHost();
+            param(ParamClockRate, i).notifyHost();
         }
     }
-    juce::ignoreUnused(parameterID, newValue);
-    _needsUpdate = true;
+    int stages = slot >= 0 ? renderStagesForParam(id) : StageAll;
+    if(stages) {
+        _dirtyStages |= stages;
+        _renderer.requestRender();
+    } else {
+        // Playback parameters are picked up by the next generate().
+        wake();
+    }
+    // After the wake, so a generator that's just been disabled still gets
+    // run to release its notes.
+    if(id == ParamEnabled || id == ParamSolo) updateFlags();
+    return;
+}
+
+void BeatGen::setFlags(uint64_t bit, std::atomic<uint64_t> *wake, std::atomic<uint64_t> *enabled, std::atomic<uint64_t> *solo) {
+    _flagBit = bit;
+    _wakeWord = wake;
+    _enabledWord = enabled;
+    _soloWord = solo;
+    this->wake();
+    if(_attached) updateFlags();
+    return;
+}
+
+// Modulation is rounded to this, so slow or tiny movements don't render a
+// new pattern every block and a cycling modulator keeps hitting the cache.
+static const float modStep = 1.0f / 256.0f;
+
+// Parameter that a modulation target moves.
+int BeatGen::modTargetParam(int target, int &index) {
+    index = 0;
+    if(target >= ModClockPhaseOffset) {
+        index = target - ModClockPhaseOffset;
+        return ParamClockPhaseOffset;
+    }
+    if(target >= ModClockLevel) {
+        index = target - ModClockLevel;
+        return ParamClockLevel;
+    }
+    switch(target) {
+        case ModLevel:          return ParamLevel;
+        case ModSwing:          return ParamSwing;
+        case ModPhaseOffset:    return ParamPhaseOffset;
+        case ModGateLength:     return ParamGateLength;
+    }
+    return 0;
+}
+
+void BeatGen::modulate(const Modulation &mod) {
+    int stages = 0;
+    bool changed = false;
+    for(int i = 0; i < ModTargetCount; i++) {
+        float amount = std::round(mod.amount[i] / modStep) * modStep;
+        if(amount == _modAmount[i].load(std::memory_order_relaxed)) continue;
+        _modAmount[i].store(amount, std::memory_order_relaxed);
+        int index;
+        stages |= renderStagesForParam(modTargetParam(i, index));
+        changed = true;
+    }
+    if(stages) {
+        _dirtyStages |= stages;
+        _renderer.requestRender();
+    } else if(changed) {
+        wake();
+    }
+    return;
+}
+
+void BeatGen::setBarLength(TickClock::Tick barLength) {
+    if(barLength == _barLength.load(std::memory_order_relaxed)) return;
+    _barLength.store(barLength, std::memory_order_relaxed);
+    // The beats are in phase, so only the ticks of the events change.
+    _dirtyStages |= StageTiming;
+    _renderer.requestRender();
+    return;
+}
+
+// Modulation target of a parameter, -1 if it can't be modulated.
+int BeatGen::modTargetForParam(int id, int index) {
+    switch(id) {
+        case ParamLevel:            return ModLevel;
+        case ParamSwing:            return ModSwing;
+        case ParamPhaseOffset:      return ModPhaseOffset;
+        case ParamGateLength:       return ModGateLength;
+        case ParamClockLevel:       return ModClockLevel + index;
+        case ParamClockPhaseOffset: return ModClockPhaseOffset + index;
+    }
+    return -1;
+}
+
+// The parameter value with any modulation added.
+float BeatGen::liveValue(int id, int index) const {
+    float value = param(id, index).value();
+    int target = modTargetForParam(id, index);
+    if(target >= 0) value += _modAmount[target].load(std::memory_order_relaxed);
+    return value;
+}
+
+void BeatGen::wake() {
+    if(_wakeWord != nullptr) _wakeWord->fetch_or(_flagBit);
+    return;
+}
+
+static void setFlag(std::atomic<uint64_t> *word, uint64_t bit, bool set) {
+    if(word == nullptr) return;
+    if(set) {
+        word->fetch_or(bit);
+    } else {
+        word->fetch_and(~bit);
+    }
+    return;
+}
+
+// Copies the enabled and solo parameters into their bits.
+void BeatGen::updateFlags() {
+    setFlag(_enabledWord, _flagBit, param(ParamEnabled).valueBool());
+    setFlag(_soloWord, _flagBit, param(ParamSolo).valueBool());
     return;
 }
 
@@ -389,114 +600,446 @@ std::unique_ptr<juce::AudioProcessorParameterGroup> BeatGen::createParameterLayo
         juce::String::formatted("Beat Gen %d", _index + 1),
         "|"
     );
-    for(auto i : _params) {
-        group->addChild(i->layout());
+    for(int slot = 0; slot < paramCount; slot++) {
+        group->addChild(paramInfo[paramRow(slot)].create(*this, _paramValues[slot]));
     }
     return group;
 }
 
 void BeatGen::attachParams(juce::AudioProcessorValueTreeState &params) {
-    for(auto i : _params) {
-        i->attach(params);
-        params.addParameterListener(i->id(), this);
+    for(auto &i : _paramValues) {
+        i.attach(params);
+        params.addParameterListener(i.id(), this);
     }
+    _attached = true;
+    updateFlags();
+    _dirtyStages = StageAll;
+    _renderer.requestRender();
     return;
 }
 
-static double phaseMultiplyAndShift(double inputPhase, double multiply, double shift, double &phaseCount) {
-    double ret = modf(inputPhase * multiply, &phaseCount);
-    ret = modf(std::abs(ret + shift + 1.0), &phaseCount);
-    return ret;
+// Phase offsets go round the pattern, so modulation past either end wraps
+// round to the other instead of sticking there.
+static float wrapPhase(float value) {
+    return value - std::floor(value);
 }
 
-double BeatGen::levelAtPhase(double phase) const {
-    double ret = _level.value();
+// Captures the value of all the parameters that affect rendering.  The
+// values that can be modulated are kept within their range, or wrapped for
+// the phase offsets.
+template <typename Value>
+PatternKey BeatGen::makePatternKey(Value value) {
+    PatternKey ret;
+    ret.steps = (int)value(ParamSteps, 0);
+    ret.bars = (int)value(ParamBars, 0);
+    ret.swing = juce::jlimit(-1.0f, 1.0f, value(ParamSwing, 0));
+    ret.level = juce::jlimit(-1.0f, 1.0f, value(ParamLevel, 0));
     for(int i = 0; i < maxClockCount; i++) {
-        double clockRate = (double)clockRateFloatToInt(_clockRate[i].value());
-        double phaseCount;
-        double clockLevel = phaseMultiplyAndShift(phase, clockRate, _clockPhaseOffset[i].value(), phaseCount);
-        clockLevel *= _clockLevel[i].value();
-        ret += clockLevel;
-    }
-    if(ret > 1.0) ret = 1.0;
-    else if(ret < 0.0) ret = 0.0;
+        PatternKey::Clock &clock = ret.clocks[i];
+        clock.enabled = value(ParamClockEnabled, i) >= 0.5f;
+        clock.rate = clockRateFloatToInt(value(ParamClockRate, i), ret.steps);
+        clock.phaseOffset = wrapPhase(value(ParamClockPhaseOffset, i));
+        clock.mixMode = (int)value(ParamClockMixMode, i);
+        clock.distribution = (int)value(ParamClockDistribution, i);
+        clock.level = juce::jlimit(-1.0f, 1.0f, value(ParamClockLevel, i));
+    }
     return ret;
 }
 
-void BeatGen::updateBeats() {
-    int bars = _bars.valueInt();
-    int steps = _steps.valueInt();
-    double swing = _swing.value();
-    double swingOffset = (0.5 / ((double)steps / (double)bars)) * swing;
-    _beats.clear();
-    BoolVector clock[maxClockCount];
-    BoolVector beatClock;
-    beatClock.assign(steps, true); // Start with all the beats turned on.
+// Captures the value of all the parameters that affect playback.
+template <typename Value>
+BeatGen::PlayParams BeatGen::makePlayParams(Value value) {
+    PlayParams ret;
+    ret.enabled = value(ParamEnabled, 0) >= 0.5f;
+    ret.note = (int)value(ParamNote, 0);
+    ret.phaseOffset = wrapPhase(value(ParamPhaseOffset, 0));
+    ret.gateMode = (int)value(ParamGateMode, 0);
+    ret.gateLength = juce::jlimit(0.0f, 1.0f, value(ParamGateLength, 0));
+    ret.gateTime = value(ParamGateTime, 0);
+    return ret;
+}
+
+PatternKey BeatGen::patternKey() const {
+    return makePatternKey([this](int id, int index) { return liveValue(id, index); });
+}
+
+// Works out the level at each phase: the base level plus a sawtooth from each
+// clock, clamped to 0.0 .. 1.0.  It's done a clock at a time across all the
+// steps so the loops have no branches or calls in them and vectorize.  The
+// fractional parts are taken by truncating to an integer, which is exact here
+// (the phase times the rate is well inside the range of an int), and the sums
+// are done in the same order as they would be a step at a time.
+static void levelKernel(const PatternKey &key, const double *phase, double *level, int count) {
+    for(int i = 0; i < count; i++) level[i] = key.level;
+    for(int c = 0; c < BeatGen::maxClockCount; c++) {
+        const PatternKey::Clock &clock = key.clocks[c];
+        if(clock.level == 0.0f) continue; // Wouldn't change anything
+        const double rate = (double)clock.rate;
+        const double shift = (double)clock.phaseOffset;
+        const double clockLevel = (double)clock.level;
+        for(int i = 0; i < count; i++) {
+            double x = phase[i] * rate;
+            double saw = std::abs((x - (double)(int)x) + shift + 1.0);
+            level[i] += (saw - (double)(int)saw) * clockLevel;
+        }
+    }
+    for(int i = 0; i < count; i++) level[i] = std::min(std::max(level[i], 0.0), 1.0);
+    return;
+}
+
+// Generates and mixes all the euclid clocks into the beat clock
+void BeatGen::renderClocks(const PatternKey &key, RenderScratch &s) {
+    int steps = key.steps;
+    StepBits &clock = s.clock;
+    StepBits &beatClock = s.beatClock;
+    beatClock.fill(steps); // Start with all the beats turned on.
     for(int i = 0; i < maxClockCount; i++) {
-        bool enabled = _clockEnabled[i].valueBool();
-        if(enabled) {
-            int rate = clockRateFloatToInt(_clockRate[i].value());
-            int offset = (int)(_clockPhaseOffset[i].value() * (double)steps);
-            int mode = _clockMixMode[i].valueInt();
-            clock[i] = generateEuclidBeat(rate, steps, offset);
-            beatClock = mixBeats(beatClock, clock[i], mode);
+        const PatternKey::Clock &clockKey = key.clocks[i];
+        if(clockKey.enabled) {
+            int rate = clockKey.rate;
+            int offset = (int)(clockKey.phaseOffset * (double)steps);
+            int mode = clockKey.mixMode;
+            // Only look up the mix kernel when the mode changes.
+            if(mode != s.mixMode[i]) {
+                s.mixMode[i] = mode;
+                s.mixKernel[i] = mixKernelForMode(mode);
+            }
+            auto dist = (EuclidTable::Distribution)clockKey.distribution;
+            generateEuclidBeat(clock, dist, rate, steps, offset);
+            s.mixKernel[i](beatClock, clock, steps);
         }
     }
+    return;
+}
+
+// Computes the start of each step in the beats
+void BeatGen::renderTiming(const PatternKey &key, RenderScratch &s) {
+    int steps = key.steps;
+    double swingOffset = (0.5 / ((double)steps / (double)key.bars)) * key.swing;
     for(int i = 0; i < steps; i++) {
-        Beat beat;
+        Beat &beat = s.beats[i];
         beat.start = (double)i / (double)steps;
         // Swing all the odd beats.
         if(i & 0x01) {
             beat.start -= swingOffset;
         }
-        beat.velocity = beatClock[i] ? levelAtPhase(beat.start) : 0.0;
-        _beats.push_back(beat);
     }
+    return;
+}
+
+// Computes the velocity of each step in the beats.  Relies on both the
+// clocks and timing being up to date.
+void BeatGen::renderVelocity(const PatternKey &key, RenderScratch &s) {
+    const StepBits &beatClock = s.beatClock;
+    for(int i = 0; i < key.steps; i++) s.phase[i] = s.beats[i].start;
+    levelKernel(key, s.phase, s.level, key.steps);
+    for(int i = 0; i < key.steps; i++) {
+        s.beats[i].velocity = beatClock.test(i) ? s.level[i] : 0.0;
+    }
+    return;
+}
+
+// Converts a pattern phase into a tick within a pattern of the given length.
+static TickClock::Tick phaseToTick(double phase, TickClock::Tick length) {
+    phase -= floor(phase);
+    return (TickClock::Tick)(phase * (double)length);
+}
+
+// Sorts the steps into the order they'll be served in.
+void BeatGen::renderOrder(const PatternKey &key, TickClock::Tick length, RenderScratch &s) {
+    for(int i = 0; i < key.steps; i++) s.order[i] = i;
+    std::sort(s.order, s.order + key.steps, [&s, length](int a, int b) {
+        TickClock::Tick ta = phaseToTick(s.beats[a].start, length);
+        TickClock::Tick tb = phaseToTick(s.beats[b].start, length);
+        return ta < tb || (ta == tb && a < b);
+    });
+    return;
+}
+
+// Brings the beats and event order in the scratch space up to date with the
+// key, from the cache if it's there.  Only the dirty stages get redone.  The
+// beats are in phase, so only the order depends on the pattern length.
+void BeatGen::renderBeats(const PatternKey &key, TickClock::Tick length, int dirty, RenderScratch &s) {
+    PatternCache &cache = PatternCache::instance();
+    if(cache.lookup(key, s.beats)) {
+        // The step starts come with the cached beats, so the timing scratch
+        // space is up to date.  The clocks aren't, if they've changed since
+        // they were last rendered, so the next render that misses redoes them.
+        s.staleStages = (s.staleStages | dirty) & StageClocks;
+        dirty |= StageTiming;
+    } else {
+        dirty |= s.staleStages;
+        s.staleStages = 0;
+        if(dirty & StageClocks) renderClocks(key, s);
+        if(dirty & StageTiming) renderTiming(key, s);
+        // Velocity depends on both of the other stages, so it's always redone.
+        renderVelocity(key, s);
+        cache.store(key, s.beats);
+    }
+    if(dirty & StageTiming) renderOrder(key, length, s);
+    return;
+}
+
+void BeatGen::fillPattern(const PatternKey &key, TickClock::Tick length, const RenderScratch &s, Pattern &pattern) {
+    pattern.steps = key.steps;
+    pattern.length = length;
+    for(int i = 0; i < pattern.steps; i++) {
+        int step = s.order[i];
+        const Beat &beat = s.beats[step];
+        Event &event = pattern.events[i];
+        event.tick = phaseToTick(beat.start, pattern.length);
+        event.velocity = beat.velocity;
+        event.step = step;
+    }
+    return;
+}
+
+bool BeatGen::render(bool publish) {
+    if(!_attached) return false;
+    int dirty = _dirtyStages.exchange(0);
+    if(dirty == 0) return false;
+
+    PatternKey key = patternKey();
+    TickClock::Tick length = _barLength.load(std::memory_order_relaxed) * key.bars;
+    renderBeats(key, length, dirty, _render);
+    Pattern &pattern = _patterns.back();
+    fillPattern(key, length, _render, pattern);
+    // The lookahead thread reads its own copy.
+    Pattern &lookahead = _lookaheadPatterns.back();
+    lookahead.steps = pattern.steps;
+    lookahead.length = pattern.length;
+    std::copy(pattern.events, pattern.events + pattern.steps, lookahead.events);
+    {
+        const juce::ScopedLock lock(_beatsLock);
+        _beats.assign(_render.beats, _render.beats + pattern.steps);
+    }
+    if(publish) publishPattern();
     _actionBroadcaster.sendActionMessage("beatsChanged");
+    return true;
+}
+
+void BeatGen::publishPattern() {
+    _patterns.publish();
+    _lookaheadPatterns.publish();
+    wake();
     return;
 }
 
-void BeatGen::generate(const GenerateState &state, juce::MidiBuffer &midi) {
-    if(_needsUpdate) {
-        _needsUpdate = false;
-        updateBeats();
-    }
-
-    double bars = _bars.value();
-    double stepSize = state.stepSize / bars;
-    double phaseStart = state.start / bars;
-    double phaseEnd = state.end / bars;
-
-    // Check all the beats and schedule the ones that occur during this generate period.
-    int phaseStartInt = (int)phaseStart;
-    int phaseEndInt = (int)phaseEnd;
-    bool enabled = state.enabled && _enabled.valueBool();
-    double phaseOffset = _phaseOffset.value();
-    int note = _note.valueInt();
-    int lastBeat = -1;
-    for(int phase = phaseStartInt; phase <= phaseEndInt; phase++) {
-        for(int i = 0; i < _beats.size(); i++) {
-            const Beat &beat = _beats[i];
-            double start = (double)phase + fmod(beat.start + phaseOffset, 1.0);
-            if(start >= phaseStart && start < phaseEnd) {
-                if(_lastNote >= 0) {
-                    int offset = (int)floor((start - phaseStart) / stepSize);
-                    midi.addEvent(juce::MidiMessage::noteOff(10, _lastNote), offset);
-                    _lastNote = -1;
-                }
-                lastBeat = i;
-                if(enabled && beat.velocity > 0.0) {
-                    //printf("G%d N%d %lf %lf %lf %lf %lf\n", _index, note, i.velocity, i.start, start, state.start, state.end);
-                    int offset = (int)ceil((start - phaseStart) / stepSize);
-                    midi.addEvent(juce::MidiMessage::noteOn(10, note, (float)beat.velocity), offset);
-                    _lastNote = note;
-                }
+void BeatGen::buildSnapshot(const juce::HashMap<juce::String, float> &values, TickClock::Tick barLength, Snapshot &snapshot) const {
+    // A saved state can hold anything, so the values are kept in range the
+    // same as the parameters would keep them.
+    auto value = [this, &values](int id, int index) {
+        const ParamValue &p = param(id, index);
+        return values.contains(p.id()) ? p.legalValue(values[p.id()]) : p.defaultValue();
+    };
+    PatternKey key = makePatternKey(value);
+    // Its own scratch space, so this can run alongside the renderer.
+    auto scratch = std::make_unique<RenderScratch>();
+    renderBeats(key, barLength * key.bars, StageAll, *scratch);
+    fillPattern(key, barLength * key.bars, *scratch, snapshot.pattern);
+    snapshot.params = makePlayParams(value);
+    snapshot.solo = value(ParamSolo, 0) >= 0.5f;
+    return;
+}
+
+void BeatGen::playSnapshot(const Snapshot *snapshot) {
+    if(snapshot == _snapshot) return;
+    _snapshot = snapshot;
+    _cursorValid = false;
+    return;
+}
+
+// Index of the first event at or after the tick within the pattern cycle.
+static int firstEventFrom(const BeatGen::Pattern &pattern, TickClock::Tick tickInCycle) {
+    const BeatGen::Event *begin = pattern.events;
+    const BeatGen::Event *end = pattern.events + pattern.steps;
+    const BeatGen::Event *event = std::lower_bound(begin, end, tickInCycle, [](const BeatGen::Event &e, TickClock::Tick t) {
+        return e.tick < t;
+    });
+    return (int)(event - begin);
+}
+
+// The phase offset is applied by shifting the window we look at in the
+// pattern, so changing it never needs a render.
+TickClock::Tick BeatGen::phaseOffsetTicks(const Pattern &pattern, float phaseOffset) {
+    return (TickClock::Tick)((double)phaseOffset * (double)pattern.length);
+}
+
+BeatGen::PlayParams BeatGen::playParams() const {
+    return makePlayParams([this](int id, int index) { return liveValue(id, index); });
+}
+
+// Points the playback cursor at the first event at or after the given tick.
+void BeatGen::seek(const Pattern &pattern, TickClock::Tick tick) {
+    TickClock::Tick cycle = TickClock::floorDiv(tick, pattern.length) * pattern.length;
+    _cursor = firstEventFrom(pattern, tick - cycle);
+    _cursorCycle = cycle;
+    _cursorValid = true;
+    return;
+}
+
+// Sets up for playing a block.  Returns false if nothing can play in it.
+bool BeatGen::startBlock(const GenerateState &state, MidiEventList &midi, PlayState &play) {
+    // Pick up the latest pattern from the renderer, if there is one.
+    if(_patterns.update()) _cursorValid = false;
+    play.params = _snapshot != nullptr ? _snapshot->params : playParams();
+    bool enabled = state.enabled && play.params.enabled;
+    // Never leave notes hanging.  Stopping the transport shows up here as
+    // being disabled.
+    if(state.flush || (_wasEnabled && !enabled)) flushNotes(midi, state.sampleStart);
+    _wasEnabled = enabled;
+    if(!enabled) {
+        // Nothing can play, so don't walk the pattern at all.  Enabling the
+        // generator, the transport or the solo always runs it again, and the
+        // cursor gets found then.
+        _cursorValid = false;
+        _nextEventTick = std::numeric_limits<TickClock::Tick>::max();
+        return false;
+    }
+    const Pattern &pattern = playingPattern();
+    play.offset = phaseOffsetTicks(pattern, play.params.phaseOffset);
+    play.gate = gateSamples(pattern, state, play.params);
+    play.bufferStart = state.sampleTime - state.sampleStart;
+    play.lastBeat = -1;
+    return true;
+}
+
+void BeatGen::playEvent(const Event &event, int sampleOffset, PlayState &play, MidiEventList &midi) {
+    // Gates that end on or before this sample go out ahead of the next note.
+    _noteOffs.process(midi, play.bufferStart, play.bufferStart + sampleOffset + 1);
+    if(_lastNote >= 0) {
+        midi.addEvent(juce::MidiMessage::noteOff(10, _lastNote), sampleOffset);
+        _lastNote = -1;
+    }
+    play.lastBeat = event.step;
+    if(event.velocity > 0.0) {
+        // Retriggering a note that's still held cuts its gate short.
+        _noteOffs.release(10, play.params.note, midi, sampleOffset);
+        midi.addEvent(juce::MidiMessage::noteOn(10, play.params.note, (float)event.velocity), sampleOffset);
+        if(play.gate < 0) {
+            _lastNote = play.params.note;
+        } else {
+            NoteOffQueue::NoteOff noteOff;
+            noteOff.time = play.bufferStart + sampleOffset + play.gate;
+            noteOff.channel = 10;
+            noteOff.note = play.params.note;
+            _noteOffs.push(noteOff, midi, sampleOffset);
+        }
+    }
+    return;
+}
+
+void BeatGen::endBlock(const GenerateState &state, const PlayState &play, MidiEventList &midi) {
+    _noteOffs.process(midi, play.bufferStart, state.sampleTime + state.block.samples);
+    // The UI polls for this.  Nothing that takes a lock can go out from here.
+    if(play.lastBeat != -1) _currentBeat.store(play.lastBeat, std::memory_order_relaxed);
+    return;
+}
+
+void BeatGen::generate(const GenerateState &state, MidiEventList &midi) {
+    PlayState play;
+    if(!startBlock(state, midi, play)) return;
+    const Pattern &pattern = playingPattern();
+    const TickClock::Block &block = state.block;
+    TickClock::Tick offset = play.offset;
+    TickClock::Tick start = block.start - offset;
+    TickClock::Tick end = block.end - offset;
+    if(pattern.steps > 0) {
+        // As long as we haven't gone back, or past the event at the cursor, we can
+        // pick up where the cursor left off.  That holds across blocks that were
+        // skipped because they had nothing in them.  Otherwise we've jumped and
+        // have to search for the first event.
+        if(!_cursorValid || start < _cursorTick || start > _cursorNextTick) seek(pattern, start);
+        for(;;) {
+            if(_cursor >= pattern.steps) {
+                _cursor = 0;
+                _cursorCycle += pattern.length;
             }
+            const Event &event = pattern.events[_cursor];
+            TickClock::Tick tick = _cursorCycle + event.tick;
+            if(tick >= end) break;
+            playEvent(event, state.sampleStart + block.sampleOffset(tick + offset), play, midi);
+            _cursor++;
+        }
+        // The loop always stops on an event past the end of the window.
+        _cursorNextTick = _cursorCycle + pattern.events[_cursor].tick;
+        _nextEventTick = _cursorNextTick + offset;
+    } else {
+        _nextEventTick = std::numeric_limits<TickClock::Tick>::max();
+    }
+    _cursorTick = end;
+    endBlock(state, play, midi);
+    return;
+}
+
+void BeatGen::generate(const GenerateState &state, MidiEventList &midi, const Event *events, int count) {
+    PlayState play;
+    if(!startBlock(state, midi, play)) return;
+    for(int i = 0; i < count; i++) {
+        playEvent(events[i], state.sampleStart + state.block.sampleOffset(events[i].tick), play, midi);
+    }
+    // The cursor has been left behind, so make sure the next generate() that
+    // walks the pattern runs and finds it again.
+    _cursorValid = false;
+    _nextEventTick = std::numeric_limits<TickClock::Tick>::min();
+    endBlock(state, play, midi);
+    return;
+}
+
+int BeatGen::lookahead(TickClock::Tick from, TickClock::Tick to, Event *events, int capacity) {
+    _lookaheadPatterns.update();
+    const Pattern &pattern = _lookaheadPatterns.front();
+    if(pattern.steps == 0) return 0;
+    TickClock::Tick offset = phaseOffsetTicks(pattern, wrapPhase(liveValue(ParamPhaseOffset, 0)));
+    TickClock::Tick start = from - offset;
+    TickClock::Tick end = to - offset;
+    TickClock::Tick cycle = TickClock::floorDiv(start, pattern.length) * pattern.length;
+    int index = firstEventFrom(pattern, start - cycle);
+    int count = 0;
+    for(;;) {
+        if(index >= pattern.steps) {
+            index = 0;
+            cycle += pattern.length;
         }
+        TickClock::Tick tick = cycle + pattern.events[index].tick;
+        if(tick >= end) break;
+        if(count == capacity) {
+            jassertfalse; // The window was longer than the pattern.
+            break;
+        }
+        events[count] = pattern.events[index];
+        events[count].tick = tick + offset;
+        count++;
+        index++;
     }
-    if(lastBeat != -1 && lastBeat != _currentBeat) {
-        _currentBeat = lastBeat;
-        _actionBroadcaster.sendActionMessage("currentBeatChanged");
+    return count;
+}
+
+void BeatGen::flushNotes(MidiEventList &midi, int sampleOffset) {
+    _noteOffs.flush(midi, sampleOffset);
+    if(_lastNote >= 0) {
+        midi.addEvent(juce::MidiMessage::noteOff(10, _lastNote), sampleOffset);
+        _lastNote = -1;
     }
     return;
 }
+
+// Returns the gate length in samples, or -1 if notes are held until the next step.
+int64_t BeatGen::gateSamples(const Pattern &pattern, const GenerateState &state, const PlayParams &params) {
+    const TickClock::Block &block = state.block;
+    double samples = -1.0;
+    switch(params.gateMode) {
+        case GateSteps:
+            if(pattern.steps > 0 && block.numerator > 0) {
+                double ticks = (double)pattern.length / (double)pattern.steps * (double)params.gateLength;
+                samples = ticks * (double)block.denominator / (double)block.numerator;
+            }
+            break;
+        case GateTime:
+            samples = (double)params.gateTime * 0.001 * state.sampleRate;
+            break;
+    }
+    if(samples < 0.0) return -1;
+    int64_t ret = (int64_t)samples;
+    return ret > 0 ? ret : 1; // Always at least a sample long
+}
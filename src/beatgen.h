@@ -1,6 +1,14 @@
 #pragma once
 
 #include <juce_audio_processors/juce_audio_processors.h>
+#include "triplebuffer.h"
+#include "stepbitset.h"
+#include "tickclock.h"
+#include "midieventlist.h"
+#include "noteoffqueue.h"
+
+class BeatRenderer;
+struct PatternKey;
 
 class Latch {
     public:
@@ -49,9 +57,7 @@ class Latch {
 // Data class to link all the different ways a parameter might be accessed.
 class ParamValue {
     public:
-        typedef std::vector<ParamValue *> PtrList;
         typedef std::unique_ptr<juce::RangedAudioParameter> RangedAudioParamUniq;
-        typedef std::function<RangedAudioParamUniq(const ParamValue &)> RangedAudioParamFunc;
 
         ParamValue() { 
 
@@ -67,21 +73,15 @@ class ParamValue {
             return _value != nullptr;
         }
 
-        void setup(PtrList &list, const juce::String &id, const juce::String &name, RangedAudioParamFunc func, int moduleID, int index = 0) {
+        void setup(const juce::String &id, const juce::String &name, int moduleID, int index = 0) {
             jassert(_id.isEmpty()); // Make sure setup isn't called twice.
             _id = id;
             _name = name;
-            _func = func;
             _moduleID = moduleID;
             _index = index;
-            list.push_back(this);
             return;
         }
 
-        RangedAudioParamUniq layout() const {
-            return _func(*this);
-        }
-
         void notifyHost() const {
             jassert(_value != nullptr);
             jassert(_param != nullptr);
@@ -102,13 +102,15 @@ class ParamValue {
         juce::RangedAudioParameter *param() const { return _param; }
         int index() const { return _index; }
         float value() const { jassert(_value != nullptr); return *_value; }
+        float defaultValue() const { jassert(_param != nullptr); return _param->convertFrom0to1(_param->getDefaultValue()); }
+        // The value the parameter would end up with if it was set to v.
+        float legalValue(float v) const { jassert(_param != nullptr); return _param->convertFrom0to1(_param->convertTo0to1(v)); }
         bool valueBool() const { jassert(_value != nullptr); return *_value >= 0.5; }
         int valueInt() const { jassert(_value != nullptr); return (int)*_value; }
 
     private:
         juce::String                _id;
         juce::String                _name;
-        RangedAudioParamFunc        _func = nullptr;
         int                         _moduleID = 0;
         int                         _index = 0;
         std::atomic<float>          *_value = nullptr;
@@ -130,14 +132,38 @@ class BeatGen : public juce::AudioProcessorValueTreeState::Listener {
             ParamClockMixMode       = 10,
             ParamClockLevel         = 11,
             ParamSwing              = 12,
-            ParamSolo               = 13
+            ParamSolo               = 13,
+            ParamClockDistribution  = 14,
+            ParamGateMode           = 15,
+            ParamGateLength         = 16,
+            ParamGateTime           = 17
         };
+        static constexpr int maxParamID = ParamGateTime;
         
+        // The stages of rendering a pattern.  Each parameter only dirties the
+        // stages it affects, so the renderer only redoes what it has to.
+        enum RenderStage {
+            StageClocks             = 0x01,     // Euclid generation and clock mixing
+            StageTiming             = 0x02,     // Step start times (swing) and event order
+            StageVelocity           = 0x04,     // Step velocities
+            StageAll                = StageClocks | StageTiming | StageVelocity
+        };
+
+        // How long each note is held for.
+        enum GateMode {
+            GateLegato              = 0,        // Until the next step
+            GateSteps               = 1,        // A fraction of a step
+            GateTime                = 2         // A fixed time in milliseconds
+        };
+
         struct GenerateState {
-            bool    enabled = true;
-            double  start = 0.0;      // Start of generate window in bar units
-            double  end = 0.0;        // End of generate window in bar units
-            double  stepSize = 0.0;   // Step size in bar units.
+            bool                enabled = true;
+            bool                flush = false;  // Send any pending note-offs first (seek, program change)
+            double              sampleRate = 44100.0;
+            int                 sampleStart = 0; // Offset of the block in the host buffer
+            int64_t             sampleTime = 0; // Absolute sample the block starts on
+            TickClock::Block    block;          // Window of ticks to generate
+            TickClock::Tick     barLength = TickClock::defaultBarLength;  // From the time signature
         };
 
         struct Beat {
@@ -145,23 +171,92 @@ class BeatGen : public juce::AudioProcessorValueTreeState::Listener {
             double  velocity = 0.0;
         };
 
+        // A beat as it's served to the audio thread.  The tick already has
+        // the swing applied and is wrapped into the length of the pattern.
+        // The generator phase offset is applied during playback.
+        struct Event {
+            TickClock::Tick     tick = 0;
+            double              velocity = 0.0;
+            int                 step = 0;
+        };
+
         typedef std::vector<Beat> BeatVector;
 
         static constexpr int firstNote = 36;
         static constexpr int maxClockCount = 4;
         static constexpr int maxBars = 8;
         static constexpr int maxClockRate = maxBars * 16;
+        // Capacity of the step kernel.  The step parameters are limited to
+        // maxClockRate, but the kernel itself will handle up to this many.
+        static constexpr int maxSteps = 4096;
+        // Parameters the generator has once, and once per clock.
+        static constexpr int globalParamCount = 11;
+        static constexpr int clockParamCount = 6;
+        static constexpr int paramCount = globalParamCount + maxClockCount * clockParamCount;
+
+        // The parameters a modulator can move.
+        enum ModTarget {
+            ModLevel                = 0,
+            ModSwing                = 1,
+            ModPhaseOffset          = 2,
+            ModGateLength           = 3,
+            ModClockLevel           = 4,                                    // One per clock
+            ModClockPhaseOffset     = ModClockLevel + maxClockCount,        // One per clock
+            ModTargetCount          = ModClockPhaseOffset + maxClockCount
+        };
+
+        // Amount added to each target, on top of the parameter value.
+        struct Modulation {
+            float               amount[ModTargetCount] = { };
+        };
+
+        typedef StepBitset<maxSteps> StepBits;
+        // Mixes a clock into the beat bits, one specialization per mix mode.
+        typedef void (*MixKernel)(StepBits &in, const StepBits &clock, int steps);
+
+        // A fully rendered beat pattern.  These are rendered by the BeatRenderer
+        // and handed to the audio thread, so they have a fixed capacity and
+        // must never allocate.
+        struct Pattern {
+            int                 steps = 0;
+            TickClock::Tick     length = TickClock::defaultBarLength;
+            Event               events[maxClockRate];   // One per step, sorted by tick.
+        };
+
+        // The parameters that affect playback.  Read once at the start of each
+        // block, so everything in the block plays from the same values.
+        struct PlayParams {
+            bool                enabled = false;
+            int                 note = 0;
+            float               phaseOffset = 0.0f;
+            int                 gateMode = GateLegato;
+            float               gateLength = 0.0f;
+            float               gateTime = 0.0f;
+        };
+
+        // Everything the generator needs to play a program, rendered ahead of
+        // time from a saved parameter state.  Never changed once it's built.
+        struct Snapshot {
+            Pattern             pattern;
+            PlayParams          params;
+            bool                solo = false;
+        };
 
         static const juce::StringArray &mixModeNames();
+        static const juce::StringArray &distributionNames();
+        static const juce::StringArray &gateModeNames();
 
-        BeatGen(int index);
+        BeatGen(int index, BeatRenderer &renderer);
         ~BeatGen();
 
         int index() const;
         bool isSolo() const;
 
         const ParamValue *getParameter(int id, int index = 0) const;
-        const BeatVector &beats() const;
+        // Returns a copy of the most recently rendered beats.  For use by the UI.
+        BeatVector beats() const;
+        // Step of the last beat played.  Set by the audio thread, so the UI
+        // has to poll it.
         int currentBeat() const;
         juce::ActionBroadcaster &actionBroadcaster();
 
@@ -169,39 +264,166 @@ class BeatGen : public juce::AudioProcessorValueTreeState::Listener {
         
         // Must be called after we create a parameter layout.
         void attachParams(juce::AudioProcessorValueTreeState &params);
-        void generate(const GenerateState &state, juce::MidiBuffer &midi);
+        // Adds the events for the block to the list, in time order.
+        void generate(const GenerateState &state, MidiEventList &midi);
+        // Plays the events given, which must be in the block, instead of
+        // walking the pattern.  Their ticks include the phase offset.
+        void generate(const GenerateState &state, MidiEventList &midi, const Event *events, int count);
+        // Called by the lookahead thread.  Writes the events between the ticks
+        // into events, with the phase offset applied, and returns how many.
+        // The window must be no longer than the pattern.
+        int lookahead(TickClock::Tick from, TickClock::Tick to, Event *events, int capacity);
+        // Sends all the note-offs that are still pending at sampleOffset.
+        void flushNotes(MidiEventList &midi, int sampleOffset);
+        // Where playback will next need this generator, as of the last generate().
+        // Tick of the next event, including the phase offset.
+        TickClock::Tick nextEventTick() const { return _nextEventTick; }
+        // Absolute sample of the next pending note-off.
+        int64_t nextNoteOffTime() const { return _noteOffs.nextTime(); }
+        // Note-offs sent early because the queue was full.  Should always be 0.
+        uint64_t noteOffOverflows() const { return _noteOffs.overflows(); }
+        // Flag words shared with the group, which this generator owns one bit
+        // of.  The bit gets set in wake whenever the generator needs to run on
+        // the next block regardless of its next event: a parameter changed or
+        // a new pattern came in.  The bits in enabled and solo follow those
+        // parameters.
+        void setFlags(uint64_t bit, std::atomic<uint64_t> *wake, std::atomic<uint64_t> *enabled, std::atomic<uint64_t> *solo);
         void parameterChanged(const juce::String &parameterID, float newValue);
+        // Called from the audio thread before generate().  Moves the targets
+        // without touching the host parameters.  Only the render stages the
+        // targets that changed affect get redone, so modulating the levels
+        // only ever redoes the velocities.
+        void modulate(const Modulation &mod);
+        static int modTargetParam(int target, int &index);
+        // Called from the audio thread when the time signature changes.  The
+        // pattern is re-rendered to the new bar length, and the old one
+        // plays until it's ready.
+        void setBarLength(TickClock::Tick barLength);
+
+        // Called by the BeatRenderer.  Renders a new pattern if the parameters
+        // have changed since the last render and returns true if it did.  If
+        // publish is false the pattern waits for publishPattern().
+        bool render(bool publish = true);
+        // Hands the last rendered pattern to the audio thread.  Must only be
+        // called by whoever the BeatRenderer has given the pattern to.
+        void publishPattern();
+
+        // Renders a snapshot from parameter values, looked up by ID, without
+        // touching the live parameters.  Anything missing takes its default.
+        // Safe to call from any thread.
+        void buildSnapshot(const juce::HashMap<juce::String, float> &values, TickClock::Tick barLength, Snapshot &snapshot) const;
+        // Audio thread.  Plays the snapshot instead of the live pattern and
+        // parameters until it's called again with nullptr.  The snapshot must
+        // stay alive until then.
+        void playSnapshot(const Snapshot *snapshot);
 
     private:
         int                                     _index { 0 };
-        int                                     _lastNote { -1 };
-        BeatVector                              _beats;
-        std::atomic<bool>                       _needsUpdate { true };
+        int                                     _lastNote { -1 };      // Legato note waiting for the next step
+        bool                                    _wasEnabled { false };
+        NoteOffQueue                            _noteOffs;
+        // Playback cursor into the current pattern (audio thread only)
+        bool                                    _cursorValid { false };
+        int                                     _cursor { 0 };
+        TickClock::Tick                         _cursorCycle { 0 };     // Start tick of the current pattern cycle
+        TickClock::Tick                         _cursorTick { 0 };      // Pattern tick the last block ended on
+        TickClock::Tick                         _cursorNextTick { 0 };  // Pattern tick of the event at the cursor
+        TickClock::Tick                         _nextEventTick { 0 };
+        const Snapshot                          *_snapshot { nullptr };  // Playing instead of the live state
+        std::atomic<uint64_t>                   *_wakeWord { nullptr };
+        std::atomic<uint64_t>                   *_enabledWord { nullptr };
+        std::atomic<uint64_t>                   *_soloWord { nullptr };
+        uint64_t                                _flagBit { 0 };
+        // Current modulation, rounded to modStep.  Written by the audio thread.
+        std::atomic<float>                      _modAmount[ModTargetCount];
+        BeatRenderer                            &_renderer;
+        TripleBuffer<Pattern>                   _patterns;
+        TripleBuffer<Pattern>                   _lookaheadPatterns;     // Same patterns, read by the lookahead thread
+        std::atomic<bool>                       _attached { false };
+        std::atomic<int>                        _dirtyStages { StageAll };
+        std::atomic<TickClock::Tick>            _barLength { TickClock::defaultBarLength };
         std::atomic<int>                        _currentBeat { 0 };
         juce::ActionBroadcaster                 _actionBroadcaster;
+        juce::CriticalSection                   _beatsLock;
+        BeatVector                              _beats;
+        // Scratch space for rendering.  The renderer keeps its own between
+        // renders, so it only has to redo the stages that changed.
+        struct RenderScratch {
+            StepBits            clock;
+            StepBits            beatClock;
+            Beat                beats[maxClockRate];
+            double              phase[maxClockRate];    // Step starts, for the level kernel
+            double              level[maxClockRate];
+            int                 order[maxClockRate];    // Steps sorted by event tick
+            int                 staleStages = StageAll;
+            int                 mixMode[maxClockCount];
+            MixKernel           mixKernel[maxClockCount];
+
+            RenderScratch();
+        };
+        RenderScratch                           _render;
+
+        // Parameters, in the order the host sees them.
+        ParamValue                  _paramValues[paramCount];
+        juce::HashMap<juce::String, int> _paramSlotsByID;     // Slot + 1 for each parameter ID
+
+        // Describes one parameter.  The rows with perClock set are repeated
+        // for every clock.
+        struct ParamInfo {
+            int             id;         // ParamID
+            bool            perClock;
+            const char      *key;       // Added to the generator (and clock) ID prefix
+            const char      *name;      // Added to the generator (and clock) name prefix
+            ParamValue::RangedAudioParamUniq (*create)(const BeatGen &gen, const ParamValue &p);
+        };
+        // Slot of each parameter by ParamID and clock index, -1 if there isn't one.
+        struct ParamSlots {
+            int             slot[maxParamID + 1][maxClockCount];
+        };
+        static const ParamInfo paramInfo[];
+        static const ParamSlots paramSlots;
+        static constexpr int paramRow(int slot);
+        static constexpr int paramClock(int slot);
+        static constexpr ParamSlots makeParamSlots();
+        const ParamValue &param(int id, int index = 0) const;
+
+        // Both take value(id, index), which returns the value of a parameter.
+        template <typename Value> static PatternKey makePatternKey(Value value);
+        template <typename Value> static PlayParams makePlayParams(Value value);
+        PatternKey patternKey() const;
+        float liveValue(int id, int index) const;
+        static int modTargetForParam(int id, int index);
+        static int renderStagesForParam(int id);
+        static void renderBeats(const PatternKey &key, TickClock::Tick length, int dirty, RenderScratch &s);
+        static void renderClocks(const PatternKey &key, RenderScratch &s);
+        static void renderTiming(const PatternKey &key, RenderScratch &s);
+        static void renderVelocity(const PatternKey &key, RenderScratch &s);
+        static void renderOrder(const PatternKey &key, TickClock::Tick length, RenderScratch &s);
+        static void fillPattern(const PatternKey &key, TickClock::Tick length, const RenderScratch &s, Pattern &pattern);
+
+        // Per block values shared by everything played in the block.
+        struct PlayState {
+            PlayParams          params;
+            TickClock::Tick     offset = 0;         // Phase offset in ticks
+            int64_t             gate = -1;
+            int64_t             bufferStart = 0;    // Absolute sample the host buffer starts on
+            int                 lastBeat = -1;
+        };
 
-        // Parameters
-        ParamValue::PtrList         _params;
-        ParamValue                  _enabled;
-        ParamValue                  _solo;
-        ParamValue                  _note;
-        ParamValue                  _steps;
-        ParamValue                  _phaseOffset;
-        ParamValue                  _bars;
-        ParamValue                  _level;
-        ParamValue                  _swing;
-        ParamValue                  _clockEnabled[maxClockCount];
-        ParamValue                  _clockRate[maxClockCount];
-        ParamValue                  _clockPhaseOffset[maxClockCount];
-        ParamValue                  _clockMixMode[maxClockCount];
-        ParamValue                  _clockLevel[maxClockCount];
-        
-        double levelAtPhase(double phase) const;
-        void updateBeats();
+        PlayParams playParams() const;
+        static TickClock::Tick phaseOffsetTicks(const Pattern &pattern, float phaseOffset);
+        const Pattern &playingPattern() const;
+        void seek(const Pattern &pattern, TickClock::Tick tick);
+        bool startBlock(const GenerateState &state, MidiEventList &midi, PlayState &play);
+        void playEvent(const Event &event, int sampleOffset, PlayState &play, MidiEventList &midi);
+        void endBlock(const GenerateState &state, const PlayState &play, MidiEventList &midi);
+        void wake();
+        void updateFlags();
+        static int64_t gateSamples(const Pattern &pattern, const GenerateState &state, const PlayParams &params);
 
         // Helper functions to map the clockRate floating point value to the clock rate integer value.
-        int clockRateFloatToInt(float val) const;
-        float clockRateIntToFloat(int value) const;
+        static int clockRateFloatToInt(float val, int steps);
+        static float clockRateIntToFloat(int value, int steps);
 
 };
 
@@ -209,16 +431,25 @@ inline int BeatGen::index() const {
     return _index;
 }
 
+inline const ParamValue &BeatGen::param(int id, int index) const {
+    return _paramValues[paramSlots.slot[id][index]];
+}
+
+inline const BeatGen::Pattern &BeatGen::playingPattern() const {
+    return _snapshot != nullptr ? _snapshot->pattern : _patterns.front();
+}
+
 inline bool BeatGen::isSolo() const {
-    return _solo.valueBool();
+    return param(ParamSolo).valueBool();
 }
 
-inline const BeatGen::BeatVector &BeatGen::beats() const {
+inline BeatGen::BeatVector BeatGen::beats() const {
+    const juce::ScopedLock lock(_beatsLock);
     return _beats;
 }
 
 inline int BeatGen::currentBeat() const {
-    return _currentBeat;
+    return _currentBeat.load(std::memory_order_relaxed);
 }
 
 inline juce::ActionBroadcaster &BeatGen::actionBroadcaster() {
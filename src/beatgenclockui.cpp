@@ -13,6 +13,7 @@ BeatGenClockUI::BeatGenClockUI(BeatGen &beatGen, int clockIndex) :
     _rate(*beatGen.getParameter(BeatGen::ParamClockRate, clockIndex)->param()),
     _phaseOffset(*beatGen.getParameter(BeatGen::ParamClockPhaseOffset, clockIndex)->param()),
     _mixMode(*beatGen.getParameter(BeatGen::ParamClockMixMode, clockIndex)->param()),
+    _distribution(*beatGen.getParameter(BeatGen::ParamClockDistribution, clockIndex)->param()),
     _level(*beatGen.getParameter(BeatGen::ParamClockLevel, clockIndex)->param())
 {
     juce::Image resetImage = juce::ImageCache::getFromMemory(BinaryData::reload_png, BinaryData::reload_pngSize);
@@ -69,6 +70,13 @@ BeatGenClockUI::BeatGenClockUI(BeatGen &beatGen, int clockIndex) :
     _mixMode.setTooltip("When used for Euclidian generation, this is the mode used to mix with the previous clock");
     addAndMakeVisible(_mixMode);
 
+    _distributionLabel.setText("Distribution", juce::dontSendNotification);
+    _distributionLabel.setJustificationType(juce::Justification::left);
+    addAndMakeVisible(_distributionLabel);
+
+    _distribution.setTooltip("How the euclidian beats are spread out over the steps");
+    addAndMakeVisible(_distribution);
+
     _levelLabel.setText("Level", juce::dontSendNotification);
     _levelLabel.setJustificationType(juce::Justification::centred);
     addAndMakeVisible(_levelLabel);
@@ -97,6 +105,7 @@ void BeatGenClockUI::resetToDefaults() {
     _rate.paramHelper().resetToDefault();
     _phaseOffset.paramHelper().resetToDefault();
     _mixMode.paramHelper().resetToDefault();
+    _distribution.paramHelper().resetToDefault();
     _level.paramHelper().resetToDefault();
     return;
 }
@@ -122,6 +131,11 @@ void BeatGenClockUI::resized() {
     r3.removeFromRight(10);
     _mixMode.setBounds(r3);
 
+    auto r4 = r.removeFromBottom(30);
+    _distributionLabel.setBounds(r4.removeFromLeft(80));
+    r4.removeFromRight(10);
+    _distribution.setBounds(r4);
+
     juce::Grid grid;
     using Track = juce::Grid::TrackInfo;
     using Fr = juce::Grid::Fr;
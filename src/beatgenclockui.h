@@ -27,6 +27,8 @@ class BeatGenClockUI : public juce::Component {
         ParamSlider         _phaseOffset;
         juce::Label         _mixModeLabel;
         ParamComboBox       _mixMode;
+        juce::Label         _distributionLabel;
+        ParamComboBox       _distribution;
         juce::Label         _levelLabel;
         ParamSlider         _level;
         juce::Label         _clockLabel;
@@ -1,11 +1,467 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include "beatgengroup.h"
 
-BeatGenGroup::BeatGenGroup(int count) {
+static const juce::Identifier ParamIdentifier("PARAM");
+static const juce::Identifier IDIdentifier("id");
+static const juce::Identifier ValueIdentifier("value");
+
+// Size of an event in a juce::MidiBuffer: the time, the size and a short message.
+static const size_t midiBufferEventBytes = sizeof(int32_t) + sizeof(uint16_t) + 3;
+
+// Writes an event to the end of the buffer the way MidiBuffer::addEvent()
+// lays it out: a 32 bit time, a 16 bit size and then the message.
+// addEvent() searches from the front for where each event goes, which makes
+// filling a buffer in time order quadratic.
+static void appendEvent(juce::MidiBuffer &midi, const uint8_t *data, int size, int sampleOffset) {
+    const int32_t time = sampleOffset;
+    const uint16_t len = (uint16_t)size;
+    uint8_t header[sizeof(time) + sizeof(len)];
+    memcpy(header, &time, sizeof(time));
+    memcpy(header + sizeof(time), &len, sizeof(len));
+    midi.data.addArray(header, (int)sizeof(header));
+    midi.data.addArray(data, size);
+    return;
+}
+
+// The layout isn't part of JUCE's API, so check appendEvent() makes the same
+// bytes addEvent() does before relying on it.
+static bool appendEventMatchesLayout() {
+    const uint8_t noteOn[] = { 0x90, 60, 100 };
+    const uint8_t noteOff[] = { 0x80, 60, 0 };
+    juce::MidiBuffer added;
+    added.addEvent(noteOn, (int)sizeof(noteOn), 7);
+    added.addEvent(noteOff, (int)sizeof(noteOff), 300);
+    juce::MidiBuffer appended;
+    appendEvent(appended, noteOn, (int)sizeof(noteOn), 7);
+    appendEvent(appended, noteOff, (int)sizeof(noteOff), 300);
+    return added.data.size() == appended.data.size() &&
+        memcmp(added.data.begin(), appended.data.begin(), (size_t)added.data.size()) == 0;
+}
+
+// Index of the lowest set bit, which must be there.
+static inline int lowestBit(uint64_t bits) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+BeatGenGroup::BeatGenGroup(int count) :
+    _modMatrix(count),
+    _events((size_t)count),
+    _nextEventTick((size_t)count, 0),
+    _nextNoteOff((size_t)count, std::numeric_limits<int64_t>::max()),
+    _due((size_t)(count + 63) / 64, 0),
+    _live((size_t)(count + 63) / 64, 0),
+    _wake((size_t)(count + 63) / 64),
+    _enabled((size_t)(count + 63) / 64),
+    _solo((size_t)(count + 63) / 64),
+    _ran((size_t)(count + 63) / 64, 0),
+    _ringPopped((size_t)BeatLookahead::ringCapacity),
+    _ringEvents((size_t)BeatLookahead::ringCapacity),
+    _ringCount((size_t)count, 0),
+    _ringStart((size_t)count, 0),
+    _mergeHeap((size_t)count),
+    _mergeCursor((size_t)count)
+{
+    for(auto &i : _wake) i.store(0);
+    for(auto &i : _enabled) i.store(0);
+    for(auto &i : _solo) i.store(0);
     for(int i = 0; i < count; i++) {
-        _beatGenVector.push_back(std::make_unique<BeatGen>(i));
+        size_t w = (size_t)i / 64;
+        _beatGenVector.push_back(std::make_unique<BeatGen>(i, _renderer));
+        // This sets the wake bit, so every generator runs on the first block.
+        _beatGenVector.back()->setFlags((uint64_t)1 << (i % 64), &_wake[w], &_enabled[w], &_solo[w]);
+        _renderer.addBeatGen(_beatGenVector.back().get());
+        _lookahead.addBeatGen(_beatGenVector.back().get());
     }
+    prepare(44100.0, 512); // Sane defaults until the host tells us otherwise.
+    _renderer.startThread();
 }
 
 BeatGenGroup::~BeatGenGroup() {
+    // Stop the threads before the BeatGen objects they use go away.
+    _lookahead.stop();
+    _renderer.stop();
+}
+
+void BeatGenGroup::setLookahead(bool enabled) {
+    if(enabled == _lookaheadRunning) return;
+    if(enabled) {
+        _lookahead.startThread();
+    } else {
+        _lookahead.stop();
+    }
+    _lookaheadRunning = enabled;
+    return;
+}
+
+// Worst case number of events a generator can make in a block.  Every step
+// can end one note and start another.  Swing can squeeze an extra step in,
+// and anything left in the note-off queue can come out too.  The most steps
+// go by in the shortest bar.
+int BeatGenGroup::maxEventsPerBlock(double sampleRate, int blockSize) {
+    double barsPerQuarterNote = (double)TickClock::ticksPerQuarterNote / (double)TickClock::minBarLength;
+    double stepsPerSample = maxTempo / 60.0 * barsPerQuarterNote * (double)BeatGen::maxClockRate / sampleRate;
+    int steps = (int)std::ceil((double)blockSize * stepsPerSample) + 2;
+    return steps * 2 + NoteOffQueue::capacity + 1;
+}
+
+void BeatGenGroup::prepare(double sampleRate, int maxBlockSize) {
+    if(sampleRate <= 0.0) sampleRate = 44100.0;
+    if(maxBlockSize < 1) maxBlockSize = 1;
+    int eventCount = maxEventsPerBlock(sampleRate, maxBlockSize);
+    for(auto &i : _events) i.reserve(eventCount);
+    _midiReserve = (size_t)(eventCount * size() + maxInputEvents) * midiBufferEventBytes;
+    _midiOut.ensureSize(_midiReserve);
+    _appendEvents = appendEventMatchesLayout();
+    if(!_appendEvents) juce::Logger::writeToLog("MidiBuffer layout has changed, merging with addEvent()");
+    return;
+}
+
+BeatGenGroup::SnapshotPtr BeatGenGroup::buildSnapshot(const juce::ValueTree &state) const {
+    // The state has a PARAM child for each parameter, with its ID and value.
+    juce::HashMap<juce::String, float> values;
+    for(int i = 0; i < state.getNumChildren(); i++) {
+        juce::ValueTree child = state.getChild(i);
+        if(!child.hasType(ParamIdentifier)) continue;
+        values.set(child.getProperty(IDIdentifier).toString(), (float)child.getProperty(ValueIdentifier));
+    }
+    auto ret = std::make_shared<Snapshot>();
+    ret->gens.resize(_beatGenVector.size());
+    ret->enabled.resize(_enabled.size(), 0);
+    ret->solo.resize(_solo.size(), 0);
+    ret->barLength = barLength();
+    for(size_t i = 0; i < _beatGenVector.size(); i++) {
+        BeatGen::Snapshot &gen = ret->gens[i];
+        _beatGenVector[i]->buildSnapshot(values, ret->barLength, gen);
+        uint64_t bit = (uint64_t)1 << (i % 64);
+        if(gen.params.enabled) ret->enabled[i / 64] |= bit;
+        if(gen.solo) ret->solo[i / 64] |= bit;
+    }
+    return ret;
+}
+
+void BeatGenGroup::publishSnapshots() {
+    _snapshots.back() = _play;
+    _snapshots.publish();
+    return;
+}
+
+void BeatGenGroup::playSnapshot(SnapshotPtr snapshot) {
+    _play.snapshot = std::move(snapshot);
+    _play.batch = _renderer.batchSequence();
+    publishSnapshots();
+    return;
+}
+
+void BeatGenGroup::queueSnapshot(SnapshotPtr snapshot, TickClock::Tick period, TickClock::Tick notBefore, uint32_t id) {
+    jassert(period > 0);
+    _play.queued = std::move(snapshot);
+    _play.period = period;
+    _play.notBefore = notBefore;
+    _play.id = id;
+    publishSnapshots();
+    return;
+}
+
+void BeatGenGroup::cancelQueuedSnapshot() {
+    _play.queued.reset();
+    _play.period = 0;
+    publishSnapshots();
+    return;
+}
+
+TickClock::Tick BeatGenGroup::longestPattern() const {
+    int bars = 1;
+    for(auto &gen : _beatGenVector) {
+        if(!gen->getParameter(BeatGen::ParamEnabled)->valueBool()) continue;
+        bars = std::max(bars, gen->getParameter(BeatGen::ParamBars)->valueInt());
+    }
+    return barLength() * bars;
+}
+
+// First multiple of the period at or after the tick.
+static TickClock::Tick alignSwitch(TickClock::Tick tick, TickClock::Tick period) {
+    return TickClock::floorDiv(tick + period - 1, period) * period;
+}
+
+// A snapshot rendered to another bar length can't be played.
+const BeatGenGroup::Snapshot *BeatGenGroup::playable(const Snapshot *snapshot) const {
+    return snapshot != nullptr && snapshot->barLength == barLength() ? snapshot : nullptr;
+}
+
+void BeatGenGroup::switchSnapshot(const Snapshot *snapshot) {
+    _snapshot = snapshot;
+    for(size_t i = 0; i < _beatGenVector.size(); i++) {
+        _beatGenVector[i]->playSnapshot(_snapshot != nullptr ? &_snapshot->gens[i] : nullptr);
+    }
+    return;
+}
+
+// Audio thread.  Picks up whatever the message thread last published.  A
+// switch made from the queue is dropped here if it isn't what's wanted now,
+// as that means it was cancelled or overtaken before its parameters loaded.
+void BeatGenGroup::pickUpSnapshots(TickClock::Tick position) {
+    if(!_snapshots.update()) return;
+    const PlaySnapshot &play = _snapshots.front();
+    // Once the batch has been published the live state plays the same thing.
+    const Snapshot *snapshot = playable(play.snapshot.get());
+    if((int32_t)(_renderer.publishedBatch() - play.batch) >= 0) snapshot = nullptr;
+    _snapshotBatch = play.batch;
+    _snapshotHeld = false;
+    if(snapshot != _snapshot) {
+        switchSnapshot(snapshot);
+        _snapshotChanged |= snapshot != nullptr;
+        _snapshotSwitched = true;
+    }
+    // The same switch can be published again after it's been made.
+    bool queued = play.period > 0 && play.id != _switchMade;
+    _queued = queued ? &play : nullptr;
+    _queuedTick = queued ? alignSwitch(std::max(position, play.notBefore), play.period) : noSwitch;
+    return;
+}
+
+TickClock::Tick BeatGenGroup::queuedSwitchTick(TickClock::Tick position) {
+    pickUpSnapshots(position);
+    return _queuedTick;
+}
+
+// Audio thread.  Switches to a new snapshot, or back to the live state once
+// the parameters have caught up.  Returns true if anything was switched, and
+// sets changed if it was a new snapshot.
+bool BeatGenGroup::updateSnapshot(const BeatGen::GenerateState &state, bool &changed) {
+    pickUpSnapshots(state.block.start);
+    bool ret = _snapshotSwitched;
+    changed = _snapshotChanged;
+    _snapshotSwitched = false;
+    _snapshotChanged = false;
+    if(_queued != nullptr) {
+        // After a seek the switch goes on the next boundary from wherever we are now.
+        if(state.flush) _queuedTick = alignSwitch(state.block.start, _queued->period);
+        // With the transport stopped there's no boundary to wait for.
+        if(_queuedTick < state.block.end || !state.enabled) {
+            const Snapshot *queued = playable(_queued->queued.get());
+            if(queued != nullptr) {
+                switchSnapshot(queued);
+                _snapshotHeld = true;
+                changed = true;
+                ret = true;
+            }
+            _switchMade = _queued->id;
+            _switchTick.store(state.enabled ? _queuedTick : state.block.start, std::memory_order_relaxed);
+            _switchID.store(_switchMade, std::memory_order_release);
+            _queued = nullptr;
+            _queuedTick = noSwitch;
+        }
+    }
+    if(_snapshot != nullptr && !_snapshotHeld && (int32_t)(_renderer.publishedBatch() - _snapshotBatch) >= 0) {
+        // Every new pattern has been published and the parameters have been
+        // loaded, so the live state plays the same thing.
+        switchSnapshot(nullptr);
+        ret = true;
+    }
+    return ret;
+}
+
+void BeatGenGroup::clearEvents() {
+    for(size_t w = 0; w < _ran.size(); w++) {
+        for(uint64_t bits = _ran[w]; bits; bits &= bits - 1) {
+            _events[w * 64 + (size_t)lowestBit(bits)].clear();
+        }
+        _ran[w] = 0;
+    }
+    return;
+}
+
+void BeatGenGroup::generate(const BeatGen::GenerateState &state) {
+    const int count = size();
+    if(state.barLength != barLength()) {
+        _barLength.store(state.barLength, std::memory_order_relaxed);
+        for(auto &gen : _beatGenVector) gen->setBarLength(state.barLength);
+    }
+    // A finished batch goes in here, so every pattern in it starts together.
+    _renderer.takeBatch();
+    // A new snapshot is a program change, which cuts off the notes from the
+    // old program.  Going back to the live state doesn't change what plays,
+    // but every generator still has to find its place in the live pattern.
+    bool changed;
+    bool switched = updateSnapshot(state, changed);
+    BeatGen::GenerateState genState = state;
+    genState.flush |= changed;
+    genState.sampleTime = _sampleTime;
+    _sampleTime += state.block.samples;
+
+    // Modulation goes in first, so any generator it moves gets woken in
+    // time to run in this block.
+    _modMatrix.process(state.block.start, state.barLength);
+    for(int n = 0; n < _modMatrix.modulatedCount(); n++) {
+        int i = _modMatrix.modulated(n);
+        _beatGenVector[(size_t)i]->modulate(_modMatrix.modulation(i));
+    }
+
+    // Starting, stopping, seeking or a change of solo affects every
+    // generator, so they all have to run.
+    bool soloed = isSoloed();
+    bool all = switched || state.flush || state.enabled != _wasRunning || soloed != _wasSoloed;
+    _wasRunning = state.enabled;
+    _wasSoloed = soloed;
+
+    // Only enabled generators can have anything to play, so the rest are
+    // never looked at.  Anything with a new pattern or a parameter change
+    // has to run, which includes a generator that's just been disabled and
+    // has notes to release.  Of the others, anything with an event or a
+    // note-off in the block has to run.
+    const TickClock::Tick tickEnd = state.block.end;
+    const int64_t sampleEnd = _sampleTime;
+    const TickClock::Tick *nextEventTick = _nextEventTick.data();
+    const int64_t *nextNoteOff = _nextNoteOff.data();
+    bool woken = false;
+    for(size_t w = 0; w < _wake.size(); w++) {
+        uint64_t woke = _wake[w].exchange(0);
+        uint64_t live = enabledWord(w) | woke;
+        uint64_t due = all ? live : woke;
+        for(uint64_t bits = live & ~due; bits; bits &= bits - 1) {
+            int bit = lowestBit(bits);
+            size_t i = w * 64 + (size_t)bit;
+            due |= (uint64_t)((nextEventTick[i] < tickEnd) | (nextNoteOff[i] < sampleEnd)) << bit;
+        }
+        woken |= woke != 0;
+        _live[w] = live;
+        _due[w] = due;
+    }
+
+    // With the lookahead running, anything that changes what's going to play
+    // restarts it from the end of this block.  Otherwise, once it has got
+    // far enough ahead the block is played from its ring instead.
+    bool fromRing = false;
+    if(_lookaheadRunning) {
+        if(all || woken) {
+            _lookahead.restart(tickEnd);
+        } else {
+            // The lookahead only knows about the live patterns.
+            fromRing = _snapshot == nullptr && _lookahead.covers(tickEnd);
+        }
+        int popped = 0;
+        _lookahead.pop(tickEnd, [&](const BeatLookahead::Entry &entry) {
+            if(fromRing && entry.event.tick >= state.block.start) _ringPopped[(size_t)popped++] = entry;
+        });
+        _lookahead.setPlayTick(tickEnd);
+        if(fromRing) {
+            // Sort the events out by generator.
+            int *ringCount = _ringCount.data();
+            int *ringStart = _ringStart.data();
+            for(int i = 0; i < count; i++) ringCount[i] = 0;
+            for(int i = 0; i < popped; i++) ringCount[_ringPopped[(size_t)i].gen]++;
+            for(int i = 0, start = 0; i < count; i++) {
+                ringStart[i] = start;
+                start += ringCount[i];
+                ringCount[i] = 0;
+            }
+            for(int i = 0; i < popped; i++) {
+                const BeatLookahead::Entry &entry = _ringPopped[(size_t)i];
+                _ringEvents[(size_t)(ringStart[entry.gen] + ringCount[entry.gen]++)] = entry.event;
+            }
+            for(size_t w = 0; w < _live.size(); w++) {
+                uint64_t due = 0;
+                for(uint64_t bits = _live[w]; bits; bits &= bits - 1) {
+                    int bit = lowestBit(bits);
+                    size_t i = w * 64 + (size_t)bit;
+                    due |= (uint64_t)((ringCount[i] > 0) | (nextNoteOff[i] < sampleEnd)) << bit;
+                }
+                _due[w] = due;
+            }
+        }
+    }
+
+    // Generators muted by a solo run as disabled, which releases their notes.
+    BeatGen::GenerateState mutedState = genState;
+    mutedState.enabled = false;
+    for(size_t w = 0; w < _due.size(); w++) {
+        uint64_t solo = soloed ? soloWord(w) : ~(uint64_t)0;
+        _ran[w] |= _due[w];
+        for(uint64_t bits = _due[w]; bits; bits &= bits - 1) {
+            int bit = lowestBit(bits);
+            size_t i = w * 64 + (size_t)bit;
+            BeatGen &gen = *_beatGenVector[i];
+            const BeatGen::GenerateState &genOrMuted = (solo >> bit) & 1 ? genState : mutedState;
+            if(fromRing) {
+                gen.generate(genOrMuted, _events[i], _ringEvents.data() + _ringStart[i], _ringCount[i]);
+            } else {
+                gen.generate(genOrMuted, _events[i]);
+            }
+            _nextEventTick[i] = gen.nextEventTick();
+            _nextNoteOff[i] = gen.nextNoteOffTime();
+        }
+    }
+    return;
+}
+
+void BeatGenGroup::mergeEvents(juce::MidiBuffer &midi) {
+    // Min heap on the time of each generator's next event.  Ties go to the
+    // lower generator so the output is the same every time.
+    auto later = [this](int a, int b) {
+        int ta = _events[(size_t)a][_mergeCursor[(size_t)a]].sampleOffset;
+        int tb = _events[(size_t)b][_mergeCursor[(size_t)b]].sampleOffset;
+        return ta != tb ? ta > tb : a > b;
+    };
+    // Only generators that ran this block can have events.
+    auto heap = _mergeHeap.begin();
+    int heapSize = 0;
+    for(size_t w = 0; w < _ran.size(); w++) {
+        for(uint64_t bits = _ran[w]; bits; bits &= bits - 1) {
+            int i = (int)w * 64 + lowestBit(bits);
+            _mergeCursor[(size_t)i] = 0;
+            if(_events[(size_t)i].size() > 0) heap[heapSize++] = i;
+        }
+    }
+    if(heapSize == 0) return;
+    std::make_heap(heap, heap + heapSize, later);
+
+    // One pass in time order, with incoming events ahead of generated ones at
+    // the same time, like MidiBuffer::addEvent() would put them.
+    auto add = [this](const uint8_t *data, int size, int sampleOffset) {
+        if(_appendEvents) {
+            appendEvent(_midiOut, data, size, sampleOffset);
+        } else {
+            _midiOut.addEvent(data, size, sampleOffset);
+        }
+    };
+    _midiOut.clear();
+    auto in = midi.cbegin();
+    auto inEnd = midi.cend();
+    while(heapSize > 0) {
+        int gen = heap[0];
+        const MidiEventList::Event &event = _events[(size_t)gen][_mergeCursor[(size_t)gen]];
+        for(; in != inEnd && (*in).samplePosition <= event.sampleOffset; ++in) {
+            const auto meta = *in;
+            add(meta.data, meta.numBytes, meta.samplePosition);
+        }
+        add(event.data, event.size, event.sampleOffset);
+        std::pop_heap(heap, heap + heapSize, later);
+        if(++_mergeCursor[(size_t)gen] < _events[(size_t)gen].size()) {
+            std::push_heap(heap, heap + heapSize, later);
+        } else {
+            heapSize--;
+        }
+    }
+    for(; in != inEnd; ++in) {
+        const auto meta = *in;
+        add(meta.data, meta.numBytes, meta.samplePosition);
+    }
 
+    // Hand the merged buffer over and keep the host's one for next time.
+    // Hosts hand in the same buffer every block, so after the first block the
+    // two reserved buffers just trade places and this never allocates.
+    midi.swapWith(_midiOut);
+    _midiOut.ensureSize(_midiReserve);
+    return;
 }
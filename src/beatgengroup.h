@@ -2,25 +2,136 @@
 #define _BEATGENGROUP_H_
 #pragma once
 
+#include <atomic>
+#include <limits>
 #include <memory>
 #include "beatgen.h"
-
+#include "beatrenderer.h"
+#include "beatlookahead.h"
+#include "modmatrix.h"
+#include "midieventlist.h"
+#include "triplebuffer.h"
 
 class BeatGenGroup {
     public:
+        // Event lists are sized for the worst case up to this tempo.  Faster than
+        // this and some events may get dropped.
+        static constexpr double maxTempo = 999.0;
+        // Room set aside in the output buffer for the incoming MIDI events.
+        static constexpr int maxInputEvents = 256;
+        // Returned by queuedSwitchTick() when nothing is queued.
+        static constexpr TickClock::Tick noSwitch = std::numeric_limits<TickClock::Tick>::max();
+
+        // Every generator's snapshot of a program, so the whole kit can switch
+        // to it at once.  Never changed once it's built, so any number of
+        // threads can hold on to one.
+        struct Snapshot {
+            std::vector<BeatGen::Snapshot>  gens;
+            std::vector<uint64_t>           enabled;    // One bit per generator, like the live flags
+            std::vector<uint64_t>           solo;
+            TickClock::Tick                 barLength = TickClock::defaultBarLength;    // Patterns were rendered to
+        };
+        typedef std::shared_ptr<const Snapshot> SnapshotPtr;
+
         BeatGenGroup(int numberOfBeatGens);
         ~BeatGenGroup();
 
+        // Sizes the event lists and output buffer for the worst case.  Must not
+        // be called while the audio thread is running, so from prepareToPlay().
+        void prepare(double sampleRate, int maxBlockSize);
+
+        // Each generator writes its events for the block into its own list.
+        MidiEventList &events(int index) {
+            return _events[(size_t)index];
+        }
+
+        void clearEvents();
+
+        // Wrap changes to the parameters of many generators at once, like a
+        // program load, so their new patterns are rendered together and start
+        // playing on the same block.
+        void beginBatch() {
+            _renderer.beginBatch();
+            return;
+        }
+
+        void endBatch() {
+            _renderer.endBatch();
+            return;
+        }
+
+        // Builds a snapshot from a parameter state made by copyState().  Any
+        // parameter missing from it takes its default.  The patterns are
+        // rendered to the current bar length.  If the time signature has
+        // changed by the time it's played, the snapshot is skipped and the
+        // engine waits for the parameters instead.
+        SnapshotPtr buildSnapshot(const juce::ValueTree &state) const;
+        // Message thread, inside the batch that loads the parameters the
+        // snapshot was built from.  The audio thread switches every generator
+        // over to the snapshot at the start of its next block, and back to the
+        // live patterns and parameters once the batch has been published.
+        void playSnapshot(SnapshotPtr snapshot);
+        // Message thread.  Queues a switch to the snapshot on the first
+        // multiple of period ticks at or after notBefore, so a program change
+        // can land on a bar.  The audio thread makes the switch by itself and
+        // holds on to the snapshot until playSnapshot() is called with it, once
+        // the parameters are loaded.  Without a snapshot the switch only marks
+        // the tick and the engine carries on.  Replaces anything already queued.
+        void queueSnapshot(SnapshotPtr snapshot, TickClock::Tick period, TickClock::Tick notBefore, uint32_t id);
+        // Cancels the queued switch.  If it's already been made and not
+        // followed by playSnapshot(), the engine goes back to what it was playing.
+        void cancelQueuedSnapshot();
+        // ID of the last queued switch made, and the tick it was made on.
+        uint32_t lastSwitch() const {
+            return _switchID.load(std::memory_order_acquire);
+        }
+
+        TickClock::Tick lastSwitchTick() const {
+            return _switchTick.load(std::memory_order_relaxed);
+        }
+
+        // Audio thread, before the block starting at the position.  Picks up a
+        // newly queued switch and returns the tick it's due on, or noSwitch.
+        TickClock::Tick queuedSwitchTick(TickClock::Tick position);
+        // Message thread.  Length of the longest pattern of any enabled generator.
+        TickClock::Tick longestPattern() const;
+        // Length of a bar in the time signature the last block played in.
+        TickClock::Tick barLength() const {
+            return _barLength.load(std::memory_order_relaxed);
+        }
+
+        // Turns the lookahead thread on or off.  Must not be called while the
+        // audio thread is running, so from prepareToPlay() or releaseResources().
+        void setLookahead(bool enabled);
+
+        // Runs every generator that has something to do in the block into its
+        // event list.  The others are skipped without being touched.
+        void generate(const BeatGen::GenerateState &state);
+
+        // Merges the events from every generator with the incoming events
+        // already in midi and puts the result back in midi.  Incoming events
+        // go ahead of generated ones at the same time.
+        void mergeEvents(juce::MidiBuffer &midi);
+
         bool isSoloed() const {
-            bool ret = false;
-            for(int i = 0; i < _beatGenVector.size(); i++) ret |= _beatGenVector.at(i)->isSolo();
-            return ret;
+            for(size_t w = 0; w < _solo.size(); w++) {
+                if(soloWord(w) != 0) return true;
+            }
+            return false;
         }
 
         int size() const {
             return (int)_beatGenVector.size();
         }
 
+        ModMatrix &modMatrix() {
+            return _modMatrix;
+        }
+
+        const ModMatrix &modMatrix() const {
+            return _modMatrix;
+        }
+
         BeatGen &operator[](int index) {
             return *_beatGenVector[index];
         }
@@ -32,8 +143,82 @@ class BeatGenGroup {
     private:
         typedef std::unique_ptr<BeatGen> BeatGenPtr;
 
+        // The renderer must outlive the BeatGen objects, as they hold a reference to it.
+        BeatRenderer                _renderer;
         std::vector<BeatGenPtr>     _beatGenVector;
-        
+        BeatLookahead               _lookahead;
+        bool                        _lookaheadRunning = false;
+        // What the message thread wants played: a snapshot until the batch
+        // that loads its parameters has been published, and a switch to make
+        // on a boundary if there's a period.  Published whole every time, so
+        // the audio thread only ever needs the latest.
+        struct PlaySnapshot {
+            SnapshotPtr             snapshot;
+            uint32_t                batch = 0;
+            SnapshotPtr             queued;
+            TickClock::Tick         period = 0;
+            TickClock::Tick         notBefore = 0;
+            uint32_t                id = 0;
+        };
+        TripleBuffer<PlaySnapshot>  _snapshots;
+        PlaySnapshot                _play;                  // Last published, message thread only
+        // Audio thread only
+        const Snapshot              *_snapshot = nullptr;   // Playing
+        uint32_t                    _snapshotBatch = 0;
+        bool                        _snapshotHeld = false;  // Switched from the queue, waiting for its parameters
+        bool                        _snapshotSwitched = false;
+        bool                        _snapshotChanged = false;
+        const PlaySnapshot          *_queued = nullptr;     // Waiting for its tick
+        TickClock::Tick             _queuedTick = noSwitch;
+        uint32_t                    _switchMade = 0;
+        std::atomic<uint32_t>       _switchID { 0 };
+        std::atomic<TickClock::Tick> _switchTick { 0 };
+        std::atomic<TickClock::Tick> _barLength { TickClock::defaultBarLength };
+        ModMatrix                   _modMatrix;
+        std::vector<MidiEventList>  _events;
+        // Playback state for every generator, in flat arrays so the test for
+        // which generators have anything in a block is one pass over all of
+        // them.  Audio thread only, apart from the wake bits.
+        std::vector<TickClock::Tick>        _nextEventTick;     // Tick of the next event
+        std::vector<int64_t>                _nextNoteOff;       // Absolute sample of the next note-off
+        std::vector<uint64_t>               _due;               // Generators to run this block, one bit each
+        std::vector<uint64_t>               _live;              // Generators that could run this block
+        // One bit per generator, kept up to date from any thread.
+        std::vector<std::atomic<uint64_t>>  _wake;              // Needs to run on the next block
+        std::vector<std::atomic<uint64_t>>  _enabled;           // Enabled parameter is on
+        std::vector<std::atomic<uint64_t>>  _solo;              // Solo parameter is on
+        std::vector<uint64_t>               _ran;               // Generators run since clearEvents(), one bit each
+        // Events for the block from the lookahead ring, sorted by generator.
+        std::vector<BeatLookahead::Entry>   _ringPopped;
+        std::vector<BeatGen::Event>         _ringEvents;
+        std::vector<int>                    _ringCount;
+        std::vector<int>                    _ringStart;
+        int64_t                     _sampleTime = 0;    // Absolute sample the next block starts on
+        bool                        _wasRunning = false;
+        bool                        _wasSoloed = false;
+        // Merge state, sized in the constructor so merging never allocates.
+        std::vector<int>            _mergeHeap;         // Generators ordered by their next event
+        std::vector<int>            _mergeCursor;       // Next event for each generator
+        juce::MidiBuffer            _midiOut;
+        size_t                      _midiReserve = 0;   // Bytes needed for the worst case block
+        bool                        _appendEvents = false; // MidiBuffer layout is the one appendEvent() writes
+
+        static int maxEventsPerBlock(double sampleRate, int blockSize);
+        void publishSnapshots();
+        void pickUpSnapshots(TickClock::Tick position);
+        bool updateSnapshot(const BeatGen::GenerateState &state, bool &changed);
+        void switchSnapshot(const Snapshot *snapshot);
+        const Snapshot *playable(const Snapshot *snapshot) const;
+
+        // While a snapshot is playing its flags stand in for the parameters.
+        uint64_t enabledWord(size_t w) const {
+            return _snapshot != nullptr ? _snapshot->enabled[w] : _enabled[w].load(std::memory_order_relaxed);
+        }
+
+        uint64_t soloWord(size_t w) const {
+            return _snapshot != nullptr ? _snapshot->solo[w] : _solo[w].load(std::memory_order_relaxed);
+        }
+
 };
 
 #endif
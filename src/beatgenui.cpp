@@ -13,6 +13,9 @@ BeatGenUI::BeatGenUI(BeatGen &beatGen) :
     _bars(*beatGen.getParameter(BeatGen::ParamBars)->param()),
     _level(*beatGen.getParameter(BeatGen::ParamLevel)->param()),
     _swing(*beatGen.getParameter(BeatGen::ParamSwing)->param()),
+    _gateMode(*beatGen.getParameter(BeatGen::ParamGateMode)->param()),
+    _gateLength(*beatGen.getParameter(BeatGen::ParamGateLength)->param()),
+    _gateTime(*beatGen.getParameter(BeatGen::ParamGateTime)->param()),
     _beatGen(beatGen)
 {    
     _enabled.setButtonText("Enabled");
@@ -73,29 +76,59 @@ BeatGenUI::BeatGenUI(BeatGen &beatGen) :
     _swing.setTooltip("Amount of swing");
     addAndMakeVisible(_swing);
 
+    _labelGateMode.setText("Gate", juce::dontSendNotification);
+    addAndMakeVisible(_labelGateMode);
+
+    _gateMode.setTooltip("How long each note is held.  Legato holds it until the next step");
+    addAndMakeVisible(_gateMode);
+
+    _labelGateLength.setText("Length", juce::dontSendNotification);
+    addAndMakeVisible(_labelGateLength);
+
+    _gateLength.setSliderStyle(juce::Slider::LinearHorizontal);
+    _gateLength.setTextBoxStyle(juce::Slider::TextEntryBoxPosition::TextBoxLeft, false, TEXTBOX_WIDTH, TEXTBOX_HEIGHT);
+    _gateLength.setTooltip("Gate length as a fraction of a step, when the gate is in Steps mode");
+    addAndMakeVisible(_gateLength);
+
+    _labelGateTime.setText("Time", juce::dontSendNotification);
+    addAndMakeVisible(_labelGateTime);
+
+    _gateTime.setSliderStyle(juce::Slider::LinearHorizontal);
+    _gateTime.setTextBoxStyle(juce::Slider::TextEntryBoxPosition::TextBoxLeft, false, TEXTBOX_WIDTH, TEXTBOX_HEIGHT);
+    _gateTime.setTooltip("Gate length in milliseconds, when the gate is in Time mode");
+    addAndMakeVisible(_gateTime);
+
     for(int i = 0; i < BeatGen::maxClockCount; i++) {
         _clocks.add(std::make_unique<BeatGenClockUI>(_beatGen, i));
         addAndMakeVisible(_clocks[i]);
     }
     addAndMakeVisible(_beatVisualizer);
     _beatGen.actionBroadcaster().addActionListener(this);
-    _beatVisualizer.setCurrentBeat(_beatGen.currentBeat());
     _beatVisualizer.setBeats(_beatGen.beats());
+    timerCallback();
+    startTimerHz(currentBeatPollHz);
 }
 
 BeatGenUI::~BeatGenUI() {
+    stopTimer();
     _beatGen.actionBroadcaster().removeActionListener(this);
 }
 
 void BeatGenUI::actionListenerCallback(const juce::String &msg) {
-    if(msg == "currentBeatChanged") {
-        _beatVisualizer.setCurrentBeat(_beatGen.currentBeat());
-    } else if(msg == "beatsChanged") {
+    if(msg == "beatsChanged") {
         _beatVisualizer.setBeats(_beatGen.beats());
     }
     return;
 }
 
+void BeatGenUI::timerCallback() {
+    int beat = _beatGen.currentBeat();
+    if(beat == _currentBeat) return;
+    _currentBeat = beat;
+    _beatVisualizer.setCurrentBeat(beat);
+    return;
+}
+
 void BeatGenUI::paint(juce::Graphics &g) {
     juce::ignoreUnused(g);
     return;
@@ -109,14 +142,16 @@ void BeatGenUI::resized() {
     using Item = juce::GridItem;
     auto r = getLocalBounds();
 
-    auto topControls = r.removeFromTop(TEXTBOX_HEIGHT * 7);
+    auto topControls = r.removeFromTop(TEXTBOX_HEIGHT * 9);
     _beatVisualizer.setBounds(topControls.removeFromRight(300));
 
     auto topLine = topControls.removeFromTop(TEXTBOX_HEIGHT);
     _enabled.setBounds(topLine.removeFromLeft(75));
     _solo.setBounds(topLine.removeFromLeft(75));
+    _labelGateMode.setBounds(topLine.removeFromLeft(50));
+    _gateMode.setBounds(topLine.removeFromLeft(100));
 
-    grid.templateRows = { Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)) };
+    grid.templateRows = { Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)), Track(Fr(1)) };
     grid.templateColumns = { Track(Px(50)), Track(Fr(1)) };
     grid.items = {
         Item(_labelNote), Item(_note),
@@ -124,7 +159,9 @@ void BeatGenUI::resized() {
         Item(_labelSteps), Item(_steps),
         Item(_labelBars), Item(_bars),
         Item(_labelPhaseOffset), Item(_phaseOffset),
-        Item(_labelSwing), Item(_swing)
+        Item(_labelSwing), Item(_swing),
+        Item(_labelGateLength), Item(_gateLength),
+        Item(_labelGateTime), Item(_gateTime)
     };
     grid.performLayout(topControls.removeFromTop(TEXTBOX_HEIGHT * grid.templateRows.size()));    
 
@@ -7,18 +7,24 @@
 #include "beatgenclockui.h"
 #include "parambutton.h"
 #include "paramslider.h"
+#include "paramcombobox.h"
 #include "beatvisualizer.h"
 
 class BeatGenUI : 
     public juce::Component, 
-    public juce::ActionListener
+    public juce::ActionListener,
+    private juce::Timer
 {
     public:
+        // The current beat is set by the audio thread, so we poll for it.
+        static constexpr int currentBeatPollHz = 30;
+
         BeatGenUI(BeatGen &beatGen);
         ~BeatGenUI();
 
     private:
         BeatGen                             &_beatGen;
+        int                                 _currentBeat = -1;
         BeatVisualizer                      _beatVisualizer;
         ParamButton                         _enabled;
         ParamButton                         _solo;
@@ -34,11 +40,18 @@ class BeatGenUI :
         ParamSlider                         _level;
         juce::Label                         _labelSwing;
         ParamSlider                         _swing;
+        juce::Label                         _labelGateMode;
+        ParamComboBox                       _gateMode;
+        juce::Label                         _labelGateLength;
+        ParamSlider                         _gateLength;
+        juce::Label                         _labelGateTime;
+        ParamSlider                         _gateTime;
         juce::OwnedArray<BeatGenClockUI>    _clocks;
 
         void paint(juce::Graphics &g) override;
         void resized() override;
         void actionListenerCallback(const juce::String &msg) override;
+        void timerCallback() override;
 
 };
 
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include "beatlookahead.h"
+
+BeatLookahead::BeatLookahead() :
+    juce::Thread("BeatLookahead"),
+    _ring(ringCapacity)
+{
+
+}
+
+BeatLookahead::~BeatLookahead() {
+    stop();
+}
+
+void BeatLookahead::addBeatGen(BeatGen *beatGen) {
+    jassert(!isThreadRunning());
+    _beatGens.push_back(beatGen);
+    // A chunk is shorter than any pattern, so each generator has at most one
+    // event per step in it.
+    _events.resize(_beatGens.size() * BeatGen::maxClockRate);
+    _chunk.reserve(_events.size());
+    return;
+}
+
+void BeatLookahead::stop() {
+    signalThreadShouldExit();
+    notify();
+    stopThread(1000);
+    return;
+}
+
+void BeatLookahead::restart(TickClock::Tick tick) {
+    _epoch++;
+    _restartTick.store(tick, std::memory_order_relaxed);
+    _restartEpoch.store(_epoch, std::memory_order_release);
+    return;
+}
+
+bool BeatLookahead::covers(TickClock::Tick tick) const {
+    if(_filledEpoch.load(std::memory_order_acquire) != _epoch) return false;
+    return _filledTick.load(std::memory_order_acquire) >= tick;
+}
+
+void BeatLookahead::run() {
+    uint32_t epoch = 0;
+    TickClock::Tick from = 0;
+    while(!threadShouldExit()) {
+        uint32_t restartEpoch = _restartEpoch.load(std::memory_order_acquire);
+        if(restartEpoch != epoch) {
+            epoch = restartEpoch;
+            from = _restartTick.load(std::memory_order_relaxed);
+            _filledTick.store(from, std::memory_order_release);
+            _filledEpoch.store(epoch, std::memory_order_release);
+        }
+        // Anything before the play position has already been played without us.
+        TickClock::Tick play = _playTick.load(std::memory_order_relaxed);
+        if(from < play) from = play;
+        TickClock::Tick target = play + lookaheadTicks;
+        while(from < target && !threadShouldExit() && _restartEpoch.load(std::memory_order_acquire) == epoch) {
+            TickClock::Tick to = std::min(target, from + chunkTicks);
+            if(!fill(epoch, from, to)) break;
+            from = to;
+            _filledTick.store(from, std::memory_order_release);
+        }
+        wait(pollMs);
+    }
+    return;
+}
+
+bool BeatLookahead::fill(uint32_t epoch, TickClock::Tick from, TickClock::Tick to) {
+    _chunk.clear();
+    const int capacity = BeatGen::maxClockRate;
+    for(int gen = 0; gen < (int)_beatGens.size(); gen++) {
+        BeatGen::Event *events = &_events[(size_t)gen * (size_t)capacity];
+        int count = _beatGens[(size_t)gen]->lookahead(from, to, events, capacity);
+        for(int i = 0; i < count; i++) {
+            Entry entry;
+            entry.event = events[i];
+            entry.gen = gen;
+            entry.epoch = epoch;
+            _chunk.push_back(entry);
+        }
+    }
+    if(_ring.space() < (int)_chunk.size()) return false;
+    // Each generator's events are already in order, so keep that for equal ticks.
+    std::stable_sort(_chunk.begin(), _chunk.end(), [](const Entry &a, const Entry &b) {
+        return a.event.tick < b.event.tick;
+    });
+    for(const auto &entry : _chunk) _ring.push(entry);
+    return true;
+}
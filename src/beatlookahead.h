@@ -0,0 +1,90 @@
+#ifndef _BEATLOOKAHEAD_H_
+#define _BEATLOOKAHEAD_H_
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <juce_core/juce_core.h>
+#include "beatgen.h"
+#include "ringbuffer.h"
+
+// Worker thread that works out the events for a set of BeatGen objects ahead
+// of playback and queues them, in tick order, in a ring for the audio thread.
+//
+// Everything queued belongs to an epoch.  Whenever something changes what
+// would play (a parameter, a new pattern, a seek) the audio thread starts a
+// new epoch from the point of the change.  Anything left over from the old
+// epoch gets thrown away as it comes out, and the worker starts again from
+// the new point.  Until it has caught up the audio thread walks the patterns
+// itself.
+class BeatLookahead : public juce::Thread {
+    public:
+        struct Entry {
+            BeatGen::Event      event;          // Tick includes the phase offset
+            int                 gen = 0;
+            uint32_t            epoch = 0;
+        };
+
+        static constexpr int ringCapacity = 8192;
+        // How far ahead of playback the worker keeps the ring filled.
+        static constexpr TickClock::Tick lookaheadTicks = TickClock::ticksPerWholeNote * 2;
+        // The ring is filled in pieces this long, so the audio thread gets
+        // something to use as soon as possible after a change.  No longer
+        // than the shortest pattern, whatever the time signature.
+        static constexpr TickClock::Tick chunkTicks = TickClock::minBarLength;
+        static constexpr int pollMs = 2;
+
+        BeatLookahead();
+        ~BeatLookahead() override;
+
+        // Must be called before the thread is started.
+        void addBeatGen(BeatGen *beatGen);
+        // Wakes the worker up and waits for it to exit.
+        void stop();
+
+        // Audio thread.  Drops everything queued and starts again from tick.
+        void restart(TickClock::Tick tick);
+        // Audio thread.  Lets the worker know playback has got up to tick.
+        void setPlayTick(TickClock::Tick tick) {
+            _playTick.store(tick, std::memory_order_relaxed);
+            return;
+        }
+        // Audio thread.  True if every event before tick is in the ring.
+        bool covers(TickClock::Tick tick) const;
+        // Audio thread.  Takes the events before tick out of the ring and
+        // calls func for each one from the current epoch.
+        template <typename Func>
+        void pop(TickClock::Tick tick, Func func);
+
+    private:
+        std::vector<BeatGen *>          _beatGens;
+        RingBuffer<Entry>               _ring;
+        uint32_t                        _epoch = 1;         // Owned by the audio thread
+        std::atomic<uint32_t>           _restartEpoch { 1 };
+        std::atomic<TickClock::Tick>    _restartTick { 0 };
+        std::atomic<TickClock::Tick>    _playTick { 0 };
+        // How far the ring has been filled, and for which epoch.
+        std::atomic<uint32_t>           _filledEpoch { 0 };
+        std::atomic<TickClock::Tick>    _filledTick { 0 };
+        // Worker scratch space.
+        std::vector<BeatGen::Event>     _events;
+        std::vector<Entry>              _chunk;
+
+        void run() override;
+        // Queues the events between from and to.  Returns false if there wasn't room.
+        bool fill(uint32_t epoch, TickClock::Tick from, TickClock::Tick to);
+};
+
+template <typename Func>
+void BeatLookahead::pop(TickClock::Tick tick, Func func) {
+    for(const Entry *entry = _ring.peek(); entry != nullptr; entry = _ring.peek()) {
+        if(entry->epoch == _epoch) {
+            if(entry->event.tick >= tick) break;
+            func(*entry);
+        }
+        _ring.pop();
+    }
+    return;
+}
+
+#endif
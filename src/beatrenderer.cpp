@@ -0,0 +1,128 @@
+#include "beatrenderer.h"
+#include "beatgen.h"
+
+BeatRenderer::BeatRenderer() :
+    juce::Thread("BeatRenderer")
+{
+
+}
+
+BeatRenderer::~BeatRenderer() {
+    stop();
+}
+
+juce::ThreadPool &BeatRenderer::pool() {
+    return _pool->pool;
+}
+
+void BeatRenderer::addBeatGen(BeatGen *beatGen) {
+    jassert(!isThreadRunning());
+    _beatGens.push_back(beatGen);
+    _batchGens.reserve(_beatGens.size());
+    return;
+}
+
+void BeatRenderer::stop() {
+    signalThreadShouldExit();
+    notify();
+    stopThread(1000);
+    return;
+}
+
+void BeatRenderer::beginBatch() {
+    bool first = _batchDepth++ == 0;
+    // Once we have the lock, the worker has seen the batch and won't start another render.
+    const juce::ScopedLock lock(_renderLock);
+    // Under the lock, so the worker never takes a batch that's still open as done.
+    if(first) _batchSequence++;
+    return;
+}
+
+void BeatRenderer::endBatch() {
+    jassert(_batchDepth > 0);
+    _batchPending = true;
+    _batchDepth--;
+    notify();
+    return;
+}
+
+bool BeatRenderer::takeBatch() {
+    int expected = HandoffReady;
+    if(!_handoff.compare_exchange_strong(expected, HandoffTaken, std::memory_order_acquire)) return false;
+    for(int i = 0; i < _batchCount; i++) _batchGens[(size_t)i]->publishPattern();
+    _publishedBatch.store(_handoffSequence, std::memory_order_release);
+    _handoff.store(HandoffIdle, std::memory_order_release);
+    return true;
+}
+
+void BeatRenderer::run() {
+    while(!threadShouldExit()) {
+        wait(pollMs);
+        if(threadShouldExit()) break;
+        // The dirty stages stay set in the generators, so a request that
+        // comes in during a batch gets rendered with it.
+        bool render = _renderPending.exchange(false, std::memory_order_acquire);
+        if(!render && !_batchPending.load()) continue;
+        bool batch = false;
+        {
+            const juce::ScopedLock lock(_renderLock);
+            // Anything that changes during a batch gets rendered when it ends.
+            if(_batchDepth > 0) continue;
+            if(_batchPending.exchange(false)) {
+                // Everything up to the latest batch gets rendered here.
+                _handoffSequence = _batchSequence.load();
+                batch = renderBatch();
+                if(!batch) _publishedBatch.store(_handoffSequence, std::memory_order_release);
+            } else {
+                for(auto gen : _beatGens) gen->render();
+            }
+        }
+        // Nothing renders until the batch has been published, but a new batch
+        // can start filling in the parameters meanwhile.
+        if(batch) handOffBatch();
+    }
+    return;
+}
+
+// Renders every dirty generator on the pool without publishing anything.
+// Returns true if there's anything to hand off.
+bool BeatRenderer::renderBatch() {
+    const int count = (int)_beatGens.size();
+    const int jobs = pool().getNumThreads();
+    _batchGens.clear();
+    _batchNext = 0;
+    _batchFinished = 0;
+    _batchDone.reset();
+    auto work = [this, count, jobs]() {
+        for(int i = _batchNext++; i < count; i = _batchNext++) {
+            if(_beatGens[(size_t)i]->render(false)) {
+                const juce::ScopedLock lock(_batchLock);
+                _batchGens.push_back(_beatGens[(size_t)i]);
+            }
+        }
+        if(++_batchFinished == jobs + 1) _batchDone.signal();
+    };
+    // This thread does its share too.
+    for(int i = 0; i < jobs; i++) pool().addJob(work);
+    work();
+    _batchDone.wait(-1);
+    _batchCount = (int)_batchGens.size();
+    return _batchCount > 0;
+}
+
+void BeatRenderer::handOffBatch() {
+    _handoff.store(HandoffReady, std::memory_order_release);
+    for(int waited = 0; _handoff.load(std::memory_order_acquire) != HandoffIdle; waited++) {
+        if(waited >= batchHandoffTimeoutMs || threadShouldExit()) {
+            // If the audio thread still hasn't started on it, take it back.
+            int expected = HandoffReady;
+            if(_handoff.compare_exchange_strong(expected, HandoffIdle, std::memory_order_acquire)) {
+                for(int i = 0; i < _batchCount; i++) _batchGens[(size_t)i]->publishPattern();
+                _publishedBatch.store(_handoffSequence, std::memory_order_release);
+                break;
+            }
+        }
+        sleep(1);
+    }
+    return;
+}
@@ -0,0 +1,107 @@
+#ifndef _BEATRENDERER_H_
+#define _BEATRENDERER_H_
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <juce_core/juce_core.h>
+
+class BeatGen;
+
+// Worker thread that renders the beat patterns for a set of BeatGen objects.
+// The BeatGen objects mark themselves dirty and call requestRender(), the
+// worker then renders the new pattern off the audio thread and the BeatGen
+// publishes it to the audio thread.  Requests come from the audio thread too,
+// so requestRender() only sets a flag, which the worker polls for.
+//
+// When a whole kit changes at once (a program or preset load) the changes
+// are batched instead.  The generators are rendered in parallel on a shared
+// pool and the audio thread publishes all the new patterns together at the
+// start of a block, so it never plays half of the old kit and half of the new.
+class BeatRenderer : public juce::Thread {
+    public:
+        // How long to wait for the audio thread to pick up a batch before
+        // assuming it isn't running and publishing it ourselves.
+        static constexpr int batchHandoffTimeoutMs = 250;
+        // How often the worker looks for render requests.
+        static constexpr int pollMs = 2;
+
+        BeatRenderer();
+        ~BeatRenderer() override;
+
+        // Must be called before the thread is started.
+        void addBeatGen(BeatGen *beatGen);
+        // Safe to call from any thread, including the audio thread.  Never
+        // blocks or takes a lock.
+        void requestRender();
+        // Wakes the worker up and waits for it to exit.
+        void stop();
+
+        // Holds rendering back while the parameters are being replaced.  Waits
+        // for any render that's already running to finish.  Calls can nest.
+        void beginBatch();
+        // Renders everything that changed since beginBatch() as one batch.
+        void endBatch();
+        // Audio thread.  Publishes a finished batch, if there's one waiting.
+        // Returns true if it did.
+        bool takeBatch();
+        // Every batch gets the next sequence number when it begins.  Nested
+        // calls are part of the same batch.
+        uint32_t batchSequence() const;
+        // Sequence number of the last batch that's been completely published,
+        // including any that turned out to have nothing in them.
+        uint32_t publishedBatch() const;
+
+    private:
+        enum Handoff {
+            HandoffIdle     = 0,
+            HandoffReady    = 1,    // The batch patterns belong to the audio thread
+            HandoffTaken    = 2     // The audio thread is publishing them
+        };
+
+        std::vector<BeatGen *>      _beatGens;
+        std::vector<BeatGen *>      _batchGens;         // Generators rendered in the batch
+        int                         _batchCount = 0;
+        std::atomic<int>            _batchDepth { 0 };
+        std::atomic<bool>           _batchPending { false };
+        std::atomic<bool>           _renderPending { false };
+        std::atomic<int>            _handoff { HandoffIdle };
+        std::atomic<uint32_t>       _batchSequence { 0 };
+        uint32_t                    _handoffSequence = 0;   // Batch being handed off
+        std::atomic<uint32_t>       _publishedBatch { 0 };
+        juce::CriticalSection       _renderLock;        // Held while rendering
+        // Shared with the pool jobs during a batch.
+        std::atomic<int>            _batchNext { 0 };
+        std::atomic<int>            _batchFinished { 0 };
+        juce::WaitableEvent         _batchDone;
+        juce::CriticalSection       _batchLock;
+        // Shared by every instance.  Batches are rare, so there's no point in
+        // each instance having its own threads sat around waiting for one.
+        // Torn down with the last instance rather than at static destruction,
+        // which in a plugin is after JUCE has shut down.
+        struct RenderPool {
+            juce::ThreadPool        pool { juce::jlimit(1, 4, juce::SystemStats::getNumCpus() - 1) };
+        };
+        juce::SharedResourcePointer<RenderPool> _pool;
+
+        juce::ThreadPool &pool();
+
+        void run() override;
+        bool renderBatch();
+        void handOffBatch();
+};
+
+inline void BeatRenderer::requestRender() {
+    _renderPending.store(true, std::memory_order_release);
+    return;
+}
+
+inline uint32_t BeatRenderer::batchSequence() const {
+    return _batchSequence.load(std::memory_order_acquire);
+}
+
+inline uint32_t BeatRenderer::publishedBatch() const {
+    return _publishedBatch.load(std::memory_order_acquire);
+}
+
+#endif
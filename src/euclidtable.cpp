@@ -0,0 +1,122 @@
+#include <array>
+#include <utility>
+#include "euclidtable.h"
+
+typedef EuclidTable::Entry Entry;
+typedef EuclidTable::Word Word;
+
+static constexpr int bitsPerWord = 64;
+
+static constexpr void setBit(Entry &entry, int bit) {
+    entry.bits[bit / bitsPerWord] |= (Word)1 << (bit % bitsPerWord);
+}
+
+static constexpr bool testBit(const Entry &entry, int bit) {
+    return (entry.bits[bit / bitsPerWord] >> (bit % bitsPerWord)) & 1;
+}
+
+// The bucket algorithm.  Matches generateEuclidBeat() in beatgen.cpp with no rotation.
+static constexpr Entry bresenhamEntry(int count, int total) {
+    Entry ret {};
+    int bucket = 0;
+    for(int x = 0; x < total; x++) {
+        bucket += count;
+        if(bucket >= total) {
+            bucket -= total;
+            setBit(ret, x);
+        }
+    }
+    return ret;
+}
+
+struct BjorklundState {
+    int     counts[32] {};
+    int     remainders[32] {};
+    int     pos = 0;
+    Entry   out {};
+};
+
+static constexpr void bjorklundBuild(BjorklundState &state, int level) {
+    if(level == -1) {
+        state.pos++; // Rest
+    } else if(level == -2) {
+        setBit(state.out, state.pos++); // Hit
+    } else {
+        for(int i = 0; i < state.counts[level]; i++) bjorklundBuild(state, level - 1);
+        if(state.remainders[level] != 0) bjorklundBuild(state, level - 2);
+    }
+}
+
+// Bjorklund's algorithm, as described by Toussaint in "The Euclidean
+// Algorithm Generates Traditional Musical Rhythms".
+static constexpr Entry bjorklundEntry(int count, int total) {
+    Entry ret {};
+    if(count <= 0) return ret;
+    if(count >= total) {
+        for(int i = 0; i < total; i++) setBit(ret, i);
+        return ret;
+    }
+    BjorklundState state;
+    int divisor = total - count;
+    int level = 0;
+    state.remainders[0] = count;
+    for(;;) {
+        state.counts[level] = divisor / state.remainders[level];
+        state.remainders[level + 1] = divisor % state.remainders[level];
+        divisor = state.remainders[level];
+        level++;
+        if(state.remainders[level] <= 1) break;
+    }
+    state.counts[level] = divisor;
+    bjorklundBuild(state, level);
+
+    // Rotate so the pattern starts on a hit.
+    int first = 0;
+    while(!testBit(state.out, first)) first++;
+    for(int i = 0; i < total; i++) {
+        if(testBit(state.out, (i + first) % total)) setBit(ret, i);
+    }
+    return ret;
+}
+
+// One row of the table per total, each as its own constant so no single
+// compile time evaluation gets too big for the compiler's limits.
+template <int Total>
+struct EuclidRow {
+    static constexpr std::array<Entry, (size_t)Total + 1> make(EuclidTable::Distribution dist) {
+        std::array<Entry, (size_t)Total + 1> ret {};
+        for(int count = 0; count <= Total; count++) {
+            ret[(size_t)count] = dist == EuclidTable::DistributionBjorklund ?
+                bjorklundEntry(count, Total) : bresenhamEntry(count, Total);
+        }
+        return ret;
+    }
+
+    static constexpr std::array<Entry, (size_t)Total + 1> bresenham = make(EuclidTable::DistributionBresenham);
+    static constexpr std::array<Entry, (size_t)Total + 1> bjorklund = make(EuclidTable::DistributionBjorklund);
+};
+
+typedef std::array<const Entry *, (size_t)EuclidTable::maxSteps + 1> RowTable;
+
+template <int... Totals>
+static constexpr RowTable bresenhamRows(std::integer_sequence<int, Totals...>) {
+    return {{ nullptr, EuclidRow<Totals + 1>::bresenham.data()... }};
+}
+
+template <int... Totals>
+static constexpr RowTable bjorklundRows(std::integer_sequence<int, Totals...>) {
+    return {{ nullptr, EuclidRow<Totals + 1>::bjorklund.data()... }};
+}
+
+static constexpr RowTable _bresenhamTable = bresenhamRows(std::make_integer_sequence<int, EuclidTable::maxSteps>());
+static constexpr RowTable _bjorklundTable = bjorklundRows(std::make_integer_sequence<int, EuclidTable::maxSteps>());
+
+const Entry &EuclidTable::pattern(Distribution dist, int count, int total) {
+    const RowTable &table = dist == DistributionBjorklund ? _bjorklundTable : _bresenhamTable;
+    return table[(size_t)total][count];
+}
+
+size_t EuclidTable::tableSize() {
+    // Row n holds n + 1 entries.
+    return (size_t)(maxSteps * (maxSteps + 1) / 2 + maxSteps) * sizeof(Entry);
+}
@@ -0,0 +1,38 @@
+#ifndef _EUCLIDTABLE_H_
+#define _EUCLIDTABLE_H_
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Precomputed euclidean rhythms for every (count, total) pair up to maxSteps.
+// The tables are generated at compile time, so there's no startup cost and
+// rendering a clock is a lookup plus a rotate.  Every pattern is stored
+// unrotated, with the first step at bit 0.
+class EuclidTable {
+    public:
+        typedef uint64_t Word;
+
+        static constexpr int maxSteps = 128;
+        static constexpr int wordCount = (maxSteps + 63) / 64;
+
+        struct Entry {
+            Word    bits[wordCount];
+        };
+
+        enum Distribution {
+            // The bucket (Bresenham) algorithm the generator has always used.
+            DistributionBresenham   = 0,
+            // Exact Bjorklund ordering, rotated so the pattern starts on a hit.
+            DistributionBjorklund   = 1
+        };
+
+        // Returns the pattern for count hits spread over total steps, where
+        // 0 <= count <= total and 1 <= total <= maxSteps.
+        static const Entry &pattern(Distribution dist, int count, int total);
+
+        // Size of a single distribution table, in bytes.
+        static size_t tableSize();
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef _MIDIEVENTLIST_H_
+#define _MIDIEVENTLIST_H_
+#pragma once
+
+#include <vector>
+#include <juce_audio_basics/juce_audio_basics.h>
+
+// List of short MIDI messages generated during a block, in time order.  The
+// capacity is set up front by reserve() so adding events on the audio thread
+// never allocates.  Events past the capacity get dropped.
+class MidiEventList {
+    public:
+        struct Event {
+            int         sampleOffset = 0;
+            int         size = 0;
+            uint8_t     data[3] = { 0, 0, 0 };
+        };
+
+        // Not safe to call from the audio thread.
+        void reserve(int capacity) {
+            _events.resize((size_t)capacity);
+            _count = 0;
+            return;
+        }
+
+        void clear() {
+            _count = 0;
+            return;
+        }
+
+        int size() const {
+            return _count;
+        }
+
+        int capacity() const {
+            return (int)_events.size();
+        }
+
+        int dropped() const {
+            return _dropped;
+        }
+
+        const Event &operator[](int index) const {
+            return _events[(size_t)index];
+        }
+
+        // Same as juce::MidiBuffer::addEvent() for short messages.
+        void addEvent(const juce::MidiMessage &msg, int sampleOffset) {
+            if(_count == (int)_events.size()) {
+                jassertfalse; // The worst case event count was wrong.
+                _dropped++;
+                return;
+            }
+            // Generators write their events in order, but keep the list sorted
+            // even if one doesn't.  Equal times keep the order they were added in.
+            int i = _count;
+            while(i > 0 && _events[(size_t)i - 1].sampleOffset > sampleOffset) {
+                _events[(size_t)i] = _events[(size_t)i - 1];
+                i--;
+            }
+            Event &event = _events[(size_t)i];
+            event.sampleOffset = sampleOffset;
+            event.size = std::min(msg.getRawDataSize(), 3);
+            std::copy(msg.getRawData(), msg.getRawData() + event.size, event.data);
+            _count++;
+            return;
+        }
+
+    private:
+        std::vector<Event>      _events;
+        int                     _count = 0;
+        int                     _dropped = 0;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include <cmath>
+#include "modmatrix.h"
+
+#define PARAM_PREFIX    "mod"
+
+// Lengths of the rates, in the same order as rateNames().  The note values
+// are a fixed length and the rest are a number of bars, which follow the
+// time signature.
+struct RatePeriod {
+    TickClock::Tick     ticks;
+    int                 bars;
+};
+static const RatePeriod ratePeriods[] = {
+    { TickClock::ticksPerWholeNote / 16,    0 },
+    { TickClock::ticksPerWholeNote / 8,     0 },
+    { TickClock::ticksPerWholeNote / 4,     0 },
+    { TickClock::ticksPerWholeNote / 2,     0 },
+    { 0,                                    1 },
+    { 0,                                    2 },
+    { 0,                                    4 },
+    { 0,                                    8 }
+};
+static const int ratePeriodCount = sizeof(ratePeriods) / sizeof(ratePeriods[0]);
+static const int defaultRate = 4;   // 1 Bar
+
+const juce::StringArray &ModMatrix::shapeNames() {
+    static juce::StringArray _shapeNames = {
+        "Sine",
+        "Triangle",
+        "Saw",
+        "Square",
+        "Steps",
+        "Random"
+    };
+    return _shapeNames;
+}
+
+const juce::StringArray &ModMatrix::rateNames() {
+    static juce::StringArray _rateNames = {
+        "1/16",
+        "1/8",
+        "1/4",
+        "1/2",
+        "1 Bar",
+        "2 Bars",
+        "4 Bars",
+        "8 Bars"
+    };
+    return _rateNames;
+}
+
+// In ModTarget order.
+const juce::StringArray &ModMatrix::targetNames() {
+    static juce::StringArray _targetNames = []() {
+        juce::StringArray ret = {
+            "Level",
+            "Swing",
+            "Phase Offset",
+            "Gate Length"
+        };
+        for(int i = 0; i < BeatGen::maxClockCount; i++) ret.add(juce::String::formatted("Clock %d Level", i + 1));
+        for(int i = 0; i < BeatGen::maxClockCount; i++) ret.add(juce::String::formatted("Clock %d Phase Offset", i + 1));
+        return ret;
+    }();
+    return _targetNames;
+}
+
+ModMatrix::ModMatrix(int beatGenCount) :
+    _beatGenCount(beatGenCount),
+    _amounts((size_t)beatGenCount)
+{
+    for(int i = 0; i < maxModulators; i++) {
+        Modulator &mod = _modulators[i];
+        mod.enabled.setup(juce::String::formatted(PARAM_PREFIX "%d_enabled", i), juce::String::formatted("Mod %d Enabled", i + 1), 0, i);
+        mod.shape.setup(juce::String::formatted(PARAM_PREFIX "%d_shape", i), juce::String::formatted("Mod %d Shape", i + 1), 0, i);
+        mod.rate.setup(juce::String::formatted(PARAM_PREFIX "%d_rate", i), juce::String::formatted("Mod %d Rate", i + 1), 0, i);
+        mod.steps.setup(juce::String::formatted(PARAM_PREFIX "%d_steps", i), juce::String::formatted("Mod %d Steps", i + 1), 0, i);
+        mod.depth.setup(juce::String::formatted(PARAM_PREFIX "%d_depth", i), juce::String::formatted("Mod %d Depth", i + 1), 0, i);
+        mod.gen.setup(juce::String::formatted(PARAM_PREFIX "%d_gen", i), juce::String::formatted("Mod %d Beat Gen", i + 1), 0, i);
+        mod.target.setup(juce::String::formatted(PARAM_PREFIX "%d_target", i), juce::String::formatted("Mod %d Target", i + 1), 0, i);
+    }
+}
+
+std::unique_ptr<juce::AudioProcessorParameterGroup> ModMatrix::createParameterLayout() const {
+    auto ret = std::make_unique<juce::AudioProcessorParameterGroup>("mod", "Modulators", "|");
+    for(int i = 0; i < maxModulators; i++) {
+        const Modulator &mod = _modulators[i];
+        auto group = std::make_unique<juce::AudioProcessorParameterGroup>(
+            juce::String::formatted(PARAM_PREFIX "%d", i),
+            juce::String::formatted("Mod %d", i + 1),
+            "|"
+        );
+        group->addChild(std::make_unique<juce::AudioParameterBool>(mod.enabled.id(), mod.enabled.name(), false));
+        group->addChild(std::make_unique<juce::AudioParameterChoice>(mod.shape.id(), mod.shape.name(), shapeNames(), ShapeSine));
+        group->addChild(std::make_unique<juce::AudioParameterChoice>(mod.rate.id(), mod.rate.name(), rateNames(), defaultRate));
+        group->addChild(std::make_unique<juce::AudioParameterInt>(mod.steps.id(), mod.steps.name(), 2, maxModSteps, 4, juce::String()));
+        group->addChild(std::make_unique<juce::AudioParameterFloat>(mod.depth.id(), mod.depth.name(), -1.0f, 1.0f, 0.5f));
+        group->addChild(std::make_unique<juce::AudioParameterInt>(mod.gen.id(), mod.gen.name(), 1, _beatGenCount, 1, juce::String()));
+        group->addChild(std::make_unique<juce::AudioParameterChoice>(mod.target.id(), mod.target.name(), targetNames(), BeatGen::ModLevel));
+        ret->addChild(std::move(group));
+    }
+    return ret;
+}
+
+void ModMatrix::attachParams(juce::AudioProcessorValueTreeState &params) {
+    for(auto &mod : _modulators) {
+        mod.enabled.attach(params);
+        mod.shape.attach(params);
+        mod.rate.attach(params);
+        mod.steps.attach(params);
+        mod.depth.attach(params);
+        mod.gen.attach(params);
+        mod.target.attach(params);
+    }
+    _attached = true;
+    return;
+}
+
+TickClock::Tick ModMatrix::ratePeriod(int rate, TickClock::Tick barLength) {
+    if(rate < 0 || rate >= ratePeriodCount) rate = defaultRate;
+    const RatePeriod &period = ratePeriods[rate];
+    return period.bars > 0 ? barLength * period.bars : period.ticks;
+}
+
+// Repeatable random value for a modulator and cycle, -1.0 .. 1.0.
+static float randomValue(int seed, TickClock::Tick cycle) {
+    uint64_t x = (uint64_t)cycle * (uint64_t)0x9e3779b97f4a7c15ull + (uint64_t)seed;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return (float)((double)(x >> 11) / (double)(1ull << 52)) - 1.0f;
+}
+
+float ModMatrix::sourceValue(int shape, int steps, int seed, TickClock::Tick tick, TickClock::Tick period) {
+    TickClock::Tick cycle = TickClock::floorDiv(tick, period);
+    double phase = (double)(tick - cycle * period) / (double)period;
+    switch(shape) {
+        case ShapeSine:
+            return (float)std::sin(phase * juce::MathConstants<double>::twoPi);
+        case ShapeTriangle:
+            return (float)(phase < 0.5 ? phase * 4.0 - 1.0 : 3.0 - phase * 4.0);
+        case ShapeSaw:
+            return (float)(phase * 2.0 - 1.0);
+        case ShapeSquare:
+            return phase < 0.5 ? 1.0f : -1.0f;
+        case ShapeSteps:
+            if(steps < 2) steps = 2;
+            return (float)(std::floor(phase * steps) / (double)(steps - 1) * 2.0 - 1.0);
+        case ShapeRandom:
+            return randomValue(seed, cycle);
+    }
+    return 0.0f;
+}
+
+void ModMatrix::process(TickClock::Tick tick, TickClock::Tick barLength) {
+    _modulatedCount = 0;
+    if(!_attached) return;
+    // Whatever was modulated last time starts from nothing, so a modulator
+    // that's been turned off or moved lets go of its old target.
+    for(int i = 0; i < _previousCount; i++) {
+        _amounts[(size_t)_previous[i]] = BeatGen::Modulation();
+        _modulated[_modulatedCount++] = _previous[i];
+    }
+    _previousCount = 0;
+    for(int i = 0; i < maxModulators; i++) {
+        const Modulator &mod = _modulators[i];
+        if(!mod.enabled.valueBool()) continue;
+        int gen = juce::jlimit(0, _beatGenCount - 1, mod.gen.valueInt() - 1);
+        int target = juce::jlimit(0, (int)BeatGen::ModTargetCount - 1, mod.target.valueInt());
+        float value = sourceValue(mod.shape.valueInt(), mod.steps.valueInt(), i, tick, ratePeriod(mod.rate.valueInt(), barLength));
+        _amounts[(size_t)gen].amount[target] += value * mod.depth.value();
+        bool listed = false;
+        for(int j = 0; j < _previousCount; j++) listed |= _previous[j] == gen;
+        if(!listed) _previous[_previousCount++] = gen;
+        listed = false;
+        for(int j = 0; j < _modulatedCount; j++) listed |= _modulated[j] == gen;
+        if(!listed) _modulated[_modulatedCount++] = gen;
+    }
+    return;
+}
@@ -0,0 +1,76 @@
+#ifndef _MODMATRIX_H_
+#define _MODMATRIX_H_
+#pragma once
+
+#include <vector>
+#include <juce_audio_processors/juce_audio_processors.h>
+#include "beatgen.h"
+#include "tickclock.h"
+
+// Modulators that move generator parameters over time without going through
+// the host parameters.  Each one is a source (an LFO shape, a staircase or a
+// random value) routed to one parameter of one generator.  They're synced to
+// the transport and worked out once per block, at the tick the block starts
+// on, so the same song position always gives the same values.
+class ModMatrix {
+    public:
+        static constexpr int maxModulators = 4;
+        static constexpr int maxModSteps = 16;
+
+        enum Shape {
+            ShapeSine               = 0,
+            ShapeTriangle           = 1,
+            ShapeSaw                = 2,
+            ShapeSquare             = 3,
+            ShapeSteps              = 4,        // Saw rounded down to a number of steps
+            ShapeRandom             = 5         // A new random value every cycle
+        };
+
+        static const juce::StringArray &shapeNames();
+        static const juce::StringArray &rateNames();
+        static const juce::StringArray &targetNames();
+
+        ModMatrix(int beatGenCount);
+
+        std::unique_ptr<juce::AudioProcessorParameterGroup> createParameterLayout() const;
+        // Must be called after we create a parameter layout.
+        void attachParams(juce::AudioProcessorValueTreeState &params);
+
+        // Audio thread.  Works out every modulator at the tick and collects
+        // the result for each generator they're routed to.  The bar rates
+        // are barLength ticks to the bar.
+        void process(TickClock::Tick tick, TickClock::Tick barLength);
+        // Generators whose modulation has to be passed on after process().
+        // That includes any that stopped being modulated, with nothing in
+        // their modulation, so they go back to their parameter values.
+        int modulatedCount() const { return _modulatedCount; }
+        int modulated(int n) const { return _modulated[n]; }
+        const BeatGen::Modulation &modulation(int gen) const { return _amounts[(size_t)gen]; }
+
+        // Value of a source at the tick, -1.0 .. 1.0.
+        static float sourceValue(int shape, int steps, int seed, TickClock::Tick tick, TickClock::Tick period);
+
+    private:
+        struct Modulator {
+            ParamValue      enabled;
+            ParamValue      shape;
+            ParamValue      rate;
+            ParamValue      steps;
+            ParamValue      depth;
+            ParamValue      gen;
+            ParamValue      target;
+        };
+
+        int                                 _beatGenCount;
+        bool                                _attached = false;
+        Modulator                           _modulators[maxModulators];
+        std::vector<BeatGen::Modulation>    _amounts;   // One per generator
+        int                                 _modulated[maxModulators * 2];
+        int                                 _modulatedCount = 0;
+        int                                 _previous[maxModulators];
+        int                                 _previousCount = 0;
+
+        static TickClock::Tick ratePeriod(int rate, TickClock::Tick barLength);
+};
+
+#endif
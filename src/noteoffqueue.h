@@ -0,0 +1,118 @@
+#ifndef _NOTEOFFQUEUE_H_
+#define _NOTEOFFQUEUE_H_
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "midieventlist.h"
+
+// Fixed capacity queue of note-offs waiting to be sent, kept sorted by the
+// absolute sample they're due on.  Note-offs that land past the end of a
+// block just stay queued for a later block.  Never allocates, so it's safe
+// to use from the audio thread.
+class NoteOffQueue {
+    public:
+        // A retriggered note has its pending note-off sent first, so there's
+        // never more than one queued for each note.  A generator only plays
+        // on one channel, so this much room can't run out however fast it
+        // plays or however long the gate.
+        static constexpr int capacity = 128;
+
+        struct NoteOff {
+            int64_t     time = 0;       // Absolute sample the note-off is due on
+            int         channel = 1;
+            int         note = 0;
+        };
+
+        bool empty() const {
+            return _count == 0;
+        }
+
+        int size() const {
+            return _count;
+        }
+
+        // Absolute sample the earliest note-off is due on, or INT64_MAX if
+        // there's nothing queued.
+        int64_t nextTime() const {
+            return _count ? _queue[0].time : INT64_MAX;
+        }
+
+        // Number of times push() has found the queue full.
+        uint64_t overflows() const {
+            return _overflows.load(std::memory_order_relaxed);
+        }
+
+        // Queues a note-off.  If the queue is full the earliest one is sent
+        // right away at sampleOffset to make room.
+        void push(const NoteOff &noteOff, MidiEventList &midi, int sampleOffset) {
+            if(_count == capacity) {
+                jassertfalse; // More notes than the queue was sized for.
+                _overflows.fetch_add(1, std::memory_order_relaxed);
+                send(_queue[0], midi, sampleOffset);
+                removeAt(0);
+            }
+            int i = _count;
+            while(i > 0 && _queue[i - 1].time > noteOff.time) {
+                _queue[i] = _queue[i - 1];
+                i--;
+            }
+            _queue[i] = noteOff;
+            _count++;
+            return;
+        }
+
+        // Sends the pending note-off for the note, if there is one, at
+        // sampleOffset.  Used when a note gets retriggered before its gate ends.
+        void release(int channel, int note, MidiEventList &midi, int sampleOffset) {
+            for(int i = 0; i < _count; i++) {
+                if(_queue[i].channel == channel && _queue[i].note == note) {
+                    send(_queue[i], midi, sampleOffset);
+                    removeAt(i);
+                    return;
+                }
+            }
+            return;
+        }
+
+        // Sends every note-off due before the absolute sample time.  The
+        // event list starts on the absolute sample bufferStart.
+        void process(MidiEventList &midi, int64_t bufferStart, int64_t time) {
+            int sent = 0;
+            while(sent < _count && _queue[sent].time < time) {
+                int64_t offset = _queue[sent].time - bufferStart;
+                send(_queue[sent], midi, offset > 0 ? (int)offset : 0);
+                sent++;
+            }
+            if(sent) {
+                for(int i = sent; i < _count; i++) _queue[i - sent] = _queue[i];
+                _count -= sent;
+            }
+            return;
+        }
+
+        // Sends everything that's still pending at sampleOffset.
+        void flush(MidiEventList &midi, int sampleOffset) {
+            for(int i = 0; i < _count; i++) send(_queue[i], midi, sampleOffset);
+            _count = 0;
+            return;
+        }
+
+    private:
+        NoteOff                 _queue[capacity];
+        int                     _count = 0;
+        std::atomic<uint64_t>   _overflows { 0 };
+
+        static void send(const NoteOff &noteOff, MidiEventList &midi, int sampleOffset) {
+            midi.addEvent(juce::MidiMessage::noteOff(noteOff.channel, noteOff.note), sampleOffset);
+            return;
+        }
+
+        void removeAt(int index) {
+            for(int i = index + 1; i < _count; i++) _queue[i - 1] = _queue[i];
+            _count--;
+            return;
+        }
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include "patterncache.h"
+
+// FNV-1a, fed one field at a time so struct padding never gets hashed.
+static void hashValue(uint64_t &hash, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return;
+}
+
+template <typename T>
+static void hashValue(uint64_t &hash, const T &value) {
+    hashValue(hash, &value, sizeof(value));
+    return;
+}
+
+// Floats have to hash the same whenever they compare equal, and -0.0f is
+// equal to 0.0f with a different bit pattern.  Either can come out of the
+// clamping and rounding the key values go through.
+static void hashValue(uint64_t &hash, float value) {
+    if(value == 0.0f) value = 0.0f;
+    hashValue(hash, &value, sizeof(value));
+    return;
+}
+
+bool PatternKey::operator==(const PatternKey &other) const {
+    if(steps != other.steps || bars != other.bars || swing != other.swing || level != other.level) return false;
+    for(int i = 0; i < BeatGen::maxClockCount; i++) {
+        const Clock &a = clocks[i];
+        const Clock &b = other.clocks[i];
+        if(a.enabled != b.enabled || a.rate != b.rate || a.phaseOffset != b.phaseOffset ||
+            a.mixMode != b.mixMode || a.distribution != b.distribution || a.level != b.level) return false;
+    }
+    return true;
+}
+
+uint64_t PatternKey::hash() const {
+    uint64_t ret = 0xcbf29ce484222325ULL;
+    hashValue(ret, steps);
+    hashValue(ret, bars);
+    hashValue(ret, swing);
+    hashValue(ret, level);
+    for(int i = 0; i < BeatGen::maxClockCount; i++) {
+        const Clock &clock = clocks[i];
+        hashValue(ret, clock.enabled);
+        hashValue(ret, clock.rate);
+        hashValue(ret, clock.phaseOffset);
+        hashValue(ret, clock.mixMode);
+        hashValue(ret, clock.distribution);
+        hashValue(ret, clock.level);
+    }
+    return ret;
+}
+
+PatternCache &PatternCache::instance() {
+    static PatternCache _cache(defaultCapacity);
+    return _cache;
+}
+
+PatternCache::PatternCache(int capacity) :
+    _capacity(capacity)
+{
+    _map.reserve((size_t)capacity);
+}
+
+PatternCache::~PatternCache() {
+
+}
+
+int PatternCache::size() const {
+    const juce::ScopedLock lock(_lock);
+    return (int)_map.size();
+}
+
+bool PatternCache::lookup(const PatternKey &key, BeatGen::Beat *beats) {
+    const juce::ScopedLock lock(_lock);
+    auto i = _map.find(key);
+    if(i == _map.end()) {
+        _misses++;
+        return false;
+    }
+    // Move the entry to the front of the list so it's the last to get evicted.
+    _entries.splice(_entries.begin(), _entries, i->second);
+    const Entry &entry = *i->second;
+    std::copy(entry.beats, entry.beats + key.steps, beats);
+    _hits++;
+    return true;
+}
+
+void PatternCache::store(const PatternKey &key, const BeatGen::Beat *beats) {
+    const juce::ScopedLock lock(_lock);
+    if(_map.find(key) != _map.end()) return; // Another BeatGen beat us to it.
+    if((int)_map.size() >= _capacity) {
+        // Reuse the least recently used entry rather than allocating a new one.
+        auto last = std::prev(_entries.end());
+        _map.erase(last->key);
+        _entries.splice(_entries.begin(), _entries, last);
+    } else {
+        _entries.emplace_front();
+    }
+    Entry &entry = _entries.front();
+    entry.key = key;
+    std::copy(beats, beats + key.steps, entry.beats);
+    _map[key] = _entries.begin();
+    return;
+}
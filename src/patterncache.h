@@ -0,0 +1,87 @@
+#ifndef _PATTERNCACHE_H_
+#define _PATTERNCACHE_H_
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <juce_core/juce_core.h>
+#include "beatgen.h"
+
+// The parameters that affect how a BeatGen pattern renders.  This is both
+// the cache key and the set of values the render is done from, so what
+// gets stored always matches the key it's stored under.
+struct PatternKey {
+    struct Clock {
+        int32_t     enabled = 0;
+        int32_t     rate = 1;           // Already mapped to an integer rate
+        float       phaseOffset = 0.0f;
+        int32_t     mixMode = 0;
+        int32_t     distribution = 0;
+        float       level = 0.0f;
+    };
+
+    int32_t     steps = 1;
+    int32_t     bars = 1;
+    float       swing = 0.0f;
+    float       level = 0.0f;
+    Clock       clocks[BeatGen::maxClockCount];
+
+    bool operator==(const PatternKey &other) const;
+    uint64_t hash() const;
+};
+
+// Process wide LRU cache of rendered patterns.  Shared by every BeatGen in
+// every plugin instance, so flipping back and forth between the same few
+// settings (automation, program changes) doesn't have to re-render.
+class PatternCache {
+    public:
+        static constexpr int defaultCapacity = 512;
+
+        // Returns the singleton instance of the PatternCache
+        static PatternCache &instance();
+
+        ~PatternCache();
+
+        // Copies the cached beats for the key into beats.  Returns false if
+        // the key isn't in the cache.
+        bool lookup(const PatternKey &key, BeatGen::Beat *beats);
+        void store(const PatternKey &key, const BeatGen::Beat *beats);
+
+        uint64_t hits() const;
+        uint64_t misses() const;
+        int size() const;
+
+    private:
+        struct Entry {
+            PatternKey      key;
+            BeatGen::Beat   beats[BeatGen::maxClockRate];
+        };
+
+        struct KeyHash {
+            size_t operator()(const PatternKey &key) const {
+                return (size_t)key.hash();
+            }
+        };
+
+        typedef std::list<Entry> EntryList;
+        typedef std::unordered_map<PatternKey, EntryList::iterator, KeyHash> EntryMap;
+
+        PatternCache(int capacity);
+
+        juce::CriticalSection       _lock;
+        int                         _capacity;
+        EntryList                   _entries;       // Most recently used at the front
+        EntryMap                    _map;
+        std::atomic<uint64_t>       _hits { 0 };
+        std::atomic<uint64_t>       _misses { 0 };
+};
+
+inline uint64_t PatternCache::hits() const {
+    return _hits;
+}
+
+inline uint64_t PatternCache::misses() const {
+    return _misses;
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include "buildinfo.h"
 
 #define MENU_NAME_PRESET "Preset"
+#define MENU_NAME_SONG   "Song"
 #define MENU_NAME_HELP   "Help"
 
 PluginEditor::PluginEditor(PluginProcessor & proc, juce::AudioProcessorValueTreeState & params) :
@@ -29,11 +30,16 @@ PluginEditor::PluginEditor(PluginProcessor & proc, juce::AudioProcessorValueTree
     setTitle(title);
     setName(title);
     setResizable(true, false);
-    for(int i = 0; i < PluginProcessor::beatGenCount; i++) {
-        _beatGenUI.add(std::make_unique<BeatGenUI>(_proc.beatGen(i)));
-        _beatGenTabs.addTab(
-         juce::String::formatted("%d", i + 1), juce::Colour(32, 32, 32), _beatGenUI[i], false);
+    if(PluginProcessor::beatGenCount > PluginProcessor::beatGenPageSize) {
+        for(int first = 0; first < PluginProcessor::beatGenCount; first += PluginProcessor::beatGenPageSize) {
+            int last = std::min(first + PluginProcessor::beatGenPageSize, PluginProcessor::beatGenCount);
+            _beatGenPage.addItem(juce::String::formatted("Gens %d-%d", first + 1, last), first / PluginProcessor::beatGenPageSize + 1);
+        }
+        _beatGenPage.onChange = [this] { showBeatGenPage(_beatGenPage.getSelectedId() - 1); };
+        _beatGenPage.setTooltip("Which page of beat generators to show");
+        addAndMakeVisible(_beatGenPage);
     }
+    showBeatGenPage(0);
     //_beatGenTabs.addTab("About", juce::Colour(32, 32, 32), &_aboutUI, false);
     addAndMakeVisible(_beatGenTabs);
     addAndMakeVisible(_tooltipWindow);
@@ -77,12 +83,32 @@ void PluginEditor::resized() {
         _bpm->setBounds(x, y, w, h);
         _bpmLabel->setBounds(x - 40, y, 40, h);
     }
+    if(_beatGenPage.isVisible()) {
+        int w = 120;
+        int x = r.getWidth() - w - (_bpm.get() != nullptr ? 350 : 0);
+        _beatGenPage.setBounds(x, 0, w, 25);
+    }
     _beatGenTabs.setBounds(r);
     return;
 }
 
+void PluginEditor::showBeatGenPage(int page) {
+    if(page < 0) page = 0;
+    int first = page * PluginProcessor::beatGenPageSize;
+    int last = std::min(first + PluginProcessor::beatGenPageSize, PluginProcessor::beatGenCount);
+    _beatGenTabs.clearTabs();
+    _beatGenUI.clear();
+    for(int i = first; i < last; i++) {
+        _beatGenUI.add(std::make_unique<BeatGenUI>(_proc.beatGen(i)));
+        _beatGenTabs.addTab(
+         juce::String::formatted("%d", i + 1), juce::Colour(32, 32, 32), _beatGenUI.getLast(), false);
+    }
+    _beatGenPage.setSelectedId(page + 1, juce::dontSendNotification);
+    return;
+}
+
 juce::StringArray PluginEditor::getMenuBarNames() {
-    juce::StringArray ret = {MENU_NAME_PRESET, MENU_NAME_HELP};
+    juce::StringArray ret = {MENU_NAME_PRESET, MENU_NAME_SONG, MENU_NAME_HELP};
     return ret;
 }
 
@@ -93,12 +119,51 @@ juce::PopupMenu PluginEditor::getMenuForIndex(int                  topLevelMenuI
     if(menuName == MENU_NAME_PRESET) {
         ret.addItem("Load Preset...", [this] { loadPreset(); });
         ret.addItem("Save Preset...", [this] { savePreset(); });
+    } else if(menuName == MENU_NAME_SONG) {
+        ret = songMenu();
     } else if(menuName == MENU_NAME_HELP) {
         ret.addItem("About...", [this] { showAbout(); });
     }
     return ret;
 }
 
+juce::PopupMenu PluginEditor::songMenu() {
+    ProgramChain &chain = _proc.programChain();
+    ProgramManager &pm = _proc.programManager();
+    juce::PopupMenu ret;
+    juce::PopupMenu quantize;
+    const juce::StringArray &quantizeNames = ProgramChain::quantizeNames();
+    for(int i = 0; i < quantizeNames.size(); i++) {
+        quantize.addItem(quantizeNames[i], true, chain.quantize() == i, [&chain, i] {
+            chain.setQuantize((ProgramChain::Quantize)i);
+        });
+    }
+    ret.addSubMenu("Quantize Program Changes", quantize);
+    ret.addSeparator();
+
+    // The chain, one line per link.
+    juce::Array<ProgramChain::Link> links = chain.links();
+    for(int i = 0; i < links.size(); i++) {
+        const ProgramChain::Link &link = links.getReference(i);
+        ret.addItem(juce::String::formatted("%d. ", i + 1) + pm.programName(link.program) +
+            juce::String::formatted(" (%d bar%s)", link.bars, link.bars == 1 ? "" : "s"), false, false, [] { });
+    }
+    juce::PopupMenu add;
+    for(int bars : { 1, 2, 4, 8, 16 }) {
+        add.addItem(juce::String::formatted("%d Bar%s", bars, bars == 1 ? "" : "s"), [&chain, &pm, bars] {
+            chain.addLink(pm.currentProgram(), bars);
+        });
+    }
+    ret.addSubMenu("Add Current Program to Chain", add);
+    if(chain.isPlaying()) {
+        ret.addItem("Stop Chain", [&chain] { chain.stop(); });
+    } else {
+        ret.addItem("Play Chain", !links.isEmpty(), false, [&chain] { chain.play(); });
+    }
+    ret.addItem("Clear Chain", !links.isEmpty(), false, [&chain] { chain.clearLinks(); });
+    return ret;
+}
+
 void PluginEditor::menuItemSelected(int menuItemID, int topLevelMenuIndex) {
     juce::ignoreUnused(menuItemID, topLevelMenuIndex);
     return;
@@ -16,17 +16,22 @@ class PluginEditor : public juce::AudioProcessorEditor, public juce::MenuBarMode
     void loadPreset();
     void savePreset();
     void showAbout();
+    // Shows the tabs for one page of generators.  The UI for each generator
+    // only exists while its page is showing.
+    void showBeatGenPage(int page);
 
   protected:
     juce::StringArray getMenuBarNames();
     juce::PopupMenu   getMenuForIndex(int topLevelMenuIndex, const juce::String & menuName);
     void              menuItemSelected(int menuItemID, int topLevelMenuIndex);
+    juce::PopupMenu   songMenu();
 
   private:
     PluginProcessor &            _proc;
     juce::MenuBarComponent       _menuBar;
     std::unique_ptr<ParamSlider> _bpm;
     std::unique_ptr<juce::Label> _bpmLabel;
+    juce::ComboBox               _beatGenPage;
     juce::TabbedComponent        _beatGenTabs;
     juce::OwnedArray<BeatGenUI>  _beatGenUI;
     juce::TooltipWindow          _tooltipWindow;
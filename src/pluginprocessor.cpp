@@ -3,10 +3,22 @@
 #include "plugineditor.h"
 #include "buildinfo.h"
 #include "applogger.h"
+#include "patterncache.h"
 
 #define APP_NAME "SickBeatBetty"
 static const juce::Identifier ParamStateIdentifier("ParamState");
 
+// What the program manager keeps for each program.
+struct ProgramSnapshot : public ProgramManager::Snapshot {
+    BeatGenGroup::SnapshotPtr   engine;
+    const BeatGenGroup          *group = nullptr;
+
+    // The engine won't play patterns rendered to another bar length.
+    bool isCurrent() const override {
+        return engine == nullptr || engine->barLength == group->barLength();
+    }
+};
+
 static int registerPluginProcessor(PluginProcessor *p) {
     juce::ignoreUnused(p);
     static int _pluginProcID = 0;
@@ -21,19 +33,34 @@ PluginProcessor::PluginProcessor() :
     _index(registerPluginProcessor(this)),
     _beatGen(beatGenCount),
     _params(*this, nullptr, ParamStateIdentifier, createParameterLayout()),
-    _programManager(APP_NAME, _params, nullptr)
+    _programManager(APP_NAME, _params, nullptr),
+    _programChain(_programManager, *this)
 {
     juce::Logger::writeToLog(juce::String("Starting up PluginProcessor ") + juce::String(_index) + " for " + getWrapperTypeDescription(wrapperType));
     for(int i = 0; i < _beatGen.size(); i++) _beatGen[i].attachParams(_params);
+    _beatGen.modMatrix().attachParams(_params);
     _bpm = _params.getRawParameterValue("bpm");
+    _programManager.setSnapshotBuilder([this](const juce::ValueTree &vtsState) {
+        auto ret = std::make_shared<ProgramSnapshot>();
+        ret->engine = _beatGen.buildSnapshot(vtsState);
+        ret->group = &_beatGen;
+        return ProgramManager::SnapshotPtr(ret);
+    });
     _programManager.init();
     _programManager.addListener(this);
-    addProgramChangeActionListener(&_programManager);
+    // Host program changes go through the chain, so they can be quantized.
+    addProgramChangeActionListener(&_programChain);
 }
 
 PluginProcessor::~PluginProcessor() {
+    const PatternCache &cache = PatternCache::instance();
+    juce::Logger::writeToLog(juce::String::formatted("Pattern cache: %d entries, %llu hits, %llu misses",
+        cache.size(), (unsigned long long)cache.hits(), (unsigned long long)cache.misses()));
+    uint64_t overflows = 0;
+    for(int i = 0; i < _beatGen.size(); i++) overflows += _beatGen[i].noteOffOverflows();
+    if(overflows > 0) juce::Logger::writeToLog(juce::String::formatted("Note-off queue overflowed %llu times", (unsigned long long)overflows));
     _programManager.removeListener(this);
-    removeProgramChangeActionListener(&_programManager);
+    removeProgramChangeActionListener(&_programChain);
 }
 
 juce::AudioProcessorValueTreeState::ParameterLayout PluginProcessor::createParameterLayout() const {
@@ -47,7 +74,27 @@ juce::AudioProcessorValueTreeState::ParameterLayout PluginProcessor::createParam
             1.0f, 999.0f, 120.0f
         ));
     }
-    for(int i = 0; i < _beatGen.size(); i++) ret.add(_beatGen[i].createParameterLayout());
+    if(_beatGen.size() <= beatGenPageSize) {
+        for(int i = 0; i < _beatGen.size(); i++) ret.add(_beatGen[i].createParameterLayout());
+    } else {
+        // With more generators than fit on a page, the host gets a group for
+        // each page so its parameter list stays usable.  The parameter IDs are
+        // the same either way, so saved state doesn't care how many pages there are.
+        for(int page = 0; page * beatGenPageSize < _beatGen.size(); page++) {
+            int first = page * beatGenPageSize;
+            int last = std::min(first + beatGenPageSize, _beatGen.size());
+            auto group = std::make_unique<juce::AudioProcessorParameterGroup>(
+                juce::String::formatted("beatgenpage%d", page),
+                juce::String::formatted("Beat Gens %d-%d", first + 1, last),
+                "|"
+            );
+            for(int i = first; i < last; i++) group->addChild(_beatGen[i].createParameterLayout());
+            ret.add(std::move(group));
+        }
+    }
+    // The modulators go last, so the generator parameters keep the indices
+    // hosts have already saved automation against.
+    ret.add(_beatGen.modMatrix().createParameterLayout());
     return ret;
 }
 
@@ -111,12 +158,14 @@ void PluginProcessor::changeProgramName(int index, const juce::String& newName)
 }
 
 void PluginProcessor::prepareToPlay(double sampleRate, int samplesPerBlock) {
-    juce::ignoreUnused(samplesPerBlock);
     _sampleRate = sampleRate;
+    _beatGen.prepare(sampleRate, samplesPerBlock);
+    _beatGen.setLookahead(useLookahead);
     return;
 }
 
 void PluginProcessor::releaseResources() {
+    _beatGen.setLookahead(false);
     return;
 }
 
@@ -129,13 +178,14 @@ void PluginProcessor::processBlock(juce::AudioBuffer<float> &audio, juce::MidiBu
     juce::AudioPlayHead *ph = getPlayHead();
     double bpm = 120.0;
     bool transportRunning = true;
+    TickClock::Tick barTicks = TickClock::defaultBarLength;
 
     if(ph != nullptr) {
         // If we've got a playhead, we're running as a plugin
         ph->getCurrentPosition(pos);
         bpm = pos.bpm;
         transportRunning = pos.isPlaying;
-        _now = pos.ppqPosition;
+        barTicks = TickClock::barLength(pos.timeSigNumerator, pos.timeSigDenominator);
     } else if(_bpm != nullptr) {
         // If we've got a _bpm parameter, we're running standalone
         bpm = *_bpm;
@@ -157,26 +207,40 @@ void PluginProcessor::processBlock(juce::AudioBuffer<float> &audio, juce::MidiBu
         _transportRunning = transportRunning;
     }
 
+    // The engine runs on the integer tick clock.  Standalone, the clock just runs
+    // free.  As a plugin, it follows the host position but only jumps if the
+    // host has moved somewhere other than where we expected it to be.
+    // Any held notes get cut off when the host jumps or the program changes.
+    bool flush = _flushNotes.exchange(false);
+    _clock.setRate(bpm, _sampleRate);
+    if(ph != nullptr && _clock.sync(TickClock::quarterNotesToTicks(pos.ppqPosition))) flush = true;
+
     BeatGen::GenerateState genState;
-    double qnPerBar = 4.0; // FIXME: We should probably read the time signature here?
-    double qnPerSample = bpm / 60.0 / _sampleRate; // Quarter notes per sample (going to be a small fraction of a quarter note)
-    double samplesPerBlock = (double)audio.getNumSamples();
-    double qnPerBlock = qnPerSample * samplesPerBlock;
     genState.enabled = transportRunning;
-    genState.start = _now / qnPerBar; 
-    genState.end = (_now + qnPerBlock) / qnPerBar;
-    genState.stepSize = qnPerSample / qnPerBar;
-    
-    //printf("%lf bpm, %d samples, %lf qnPerSample, %lf start, %lf end\n",
-    //    bpm, audio.getNumSamples(), qnPerSample, genState.start, genState.end);
-    // FIXME: Move this loop into the BeatGenGroup object
-    bool noSolo = !_beatGen.isSoloed(); 
-    for(int i = 0; i < _beatGen.size(); i++) {
-        BeatGen &gen = _beatGen[i];
-        if(noSolo || gen.isSolo()) {
-            _beatGen[i].generate(genState, midi);
+    genState.flush = flush;
+    genState.sampleRate = _sampleRate;
+    genState.barLength = barTicks;
+
+    // JUCE doesn't expose the host's sample-accurate parameter queues, and
+    // sets every parameter before the block, so splitting the block wouldn't
+    // pick up any changes.  It's only split where a queued program change
+    // starts, on the sample its tick falls in.
+    int numSamples = audio.getNumSamples();
+    _beatGen.clearEvents();
+    for(int offset = 0; offset < numSamples; ) {
+        int samples = numSamples - offset;
+        TickClock::Tick switchTick = _beatGen.queuedSwitchTick(_clock.position());
+        if(switchTick != BeatGenGroup::noSwitch) {
+            int until = _clock.samplesUntil(switchTick, samples);
+            if(until > 0) samples = until;
         }
+        genState.sampleStart = offset;
+        genState.block = _clock.advance(samples);
+        _beatGen.generate(genState);
+        genState.flush = false;
+        offset += samples;
     }
+    _beatGen.mergeEvents(midi);
 
     /*
     if(programChange != -1) {
@@ -186,7 +250,6 @@ void PluginProcessor::processBlock(juce::AudioBuffer<float> &audio, juce::MidiBu
     }
     */
 
-    _now += qnPerBlock;
     return;
 }
 
@@ -205,23 +268,30 @@ bool PluginProcessor::hasEditor() const {
 }
 
 void PluginProcessor::getStateInformation(juce::MemoryBlock &destData) {
-    StateXML xml = _programManager.getStateXML();
-    copyXmlToBinary(*xml, destData);
+    _programManager.getStateBinary(destData);
     juce::Logger::writeToLog("Saved state");
     return;
 }
 
 void PluginProcessor::setStateInformation(const void *data, int sizeInBytes) {
-    StateXML xml(getXmlFromBinary(data, sizeInBytes));
-    if(xml.get() == nullptr) {
-        juce::Logger::writeToLog("Failed to parse state XML");
-        return;
+    if(sizeInBytes < 0) return;
+    if(ProgramManager::isStateBinary(data, (size_t)sizeInBytes)) {
+        _programManager.setStateFromBinary(data, (size_t)sizeInBytes);
+    } else {
+        // Saved by a version from before the binary state.
+        StateXML xml(getXmlFromBinary(data, sizeInBytes));
+        if(xml.get() == nullptr) {
+            juce::Logger::writeToLog("Failed to parse state XML");
+            return;
+        }
+        _programManager.setStateFromXML(xml);
     }
-    _programManager.setStateFromXML(xml);
+    _flushNotes = true;
     return;
 }
 
 void PluginProcessor::programManagerProgramChanged(int value) {
+    // The notes were flushed when the engine switched to the new program.
     int max = _programManager.programCount();
     int hostValue = _hostProgram;
     if(hostValue < 0) hostValue = 0;
@@ -242,3 +312,44 @@ void PluginProcessor::programManagerListChanged() {
     //juce::Logger::writeToLog("Update host on program list change");
     return;
 }
+
+void PluginProcessor::programManagerStateWillLoad(const ProgramManager::SnapshotPtr &snapshot) {
+    _beatGen.beginBatch();
+    // The engine switches to the new program on the next block, and the
+    // parameters catch up with it while it plays.
+    if(snapshot != nullptr) _beatGen.playSnapshot(static_cast<const ProgramSnapshot &>(*snapshot).engine);
+    return;
+}
+
+void PluginProcessor::programManagerStateLoaded() {
+    _beatGen.endBatch();
+    return;
+}
+
+void PluginProcessor::queueProgramSwitch(const ProgramManager::SnapshotPtr &snapshot, TickClock::Tick period, TickClock::Tick notBefore, uint32_t id) {
+    BeatGenGroup::SnapshotPtr engine;
+    if(snapshot != nullptr) engine = static_cast<const ProgramSnapshot &>(*snapshot).engine;
+    _beatGen.queueSnapshot(engine, period, notBefore, id);
+    return;
+}
+
+void PluginProcessor::cancelProgramSwitch() {
+    _beatGen.cancelQueuedSnapshot();
+    return;
+}
+
+uint32_t PluginProcessor::lastProgramSwitch() const {
+    return _beatGen.lastSwitch();
+}
+
+TickClock::Tick PluginProcessor::lastProgramSwitchTick() const {
+    return _beatGen.lastSwitchTick();
+}
+
+TickClock::Tick PluginProcessor::patternLength() const {
+    return _beatGen.longestPattern();
+}
+
+TickClock::Tick PluginProcessor::barLength() const {
+    return _beatGen.barLength();
+}
@@ -4,12 +4,31 @@
 #include "beatgengroup.h"
 #include "applogger.h"
 #include "programmanager.h"
-
-class PluginProcessor : public juce::AudioProcessor, public ProgramManager::Listener {
+#include "programchain.h"
+
+// Set from the build with -DBEATGEN_COUNT=n
+#ifndef BEATGEN_COUNT
+#define BEATGEN_COUNT 16
+#endif
+#ifndef BEATGEN_LOOKAHEAD
+#define BEATGEN_LOOKAHEAD 0
+#endif
+
+class PluginProcessor :
+    public juce::AudioProcessor,
+    public ProgramManager::Listener,
+    public ProgramChain::Engine
+{
   public:
     typedef std::unique_ptr<juce::XmlElement> StateXML;
 
-    static const int beatGenCount = 16;
+    static const int beatGenCount = BEATGEN_COUNT;
+    static_assert(beatGenCount >= 1 && beatGenCount <= 128, "BEATGEN_COUNT must be between 1 and 128");
+    // Generators are grouped into pages of this many, both in the host's
+    // parameter list and in the editor.
+    static const int beatGenPageSize = 16;
+    // Plays the generators from events queued ahead by the lookahead thread.
+    static const bool useLookahead = BEATGEN_LOOKAHEAD != 0;
 
     PluginProcessor();
     ~PluginProcessor() override;
@@ -47,6 +66,9 @@ class PluginProcessor : public juce::AudioProcessor, public ProgramManager::List
     ProgramManager &       programManager();
     const ProgramManager & programManager() const;
 
+    ProgramChain &       programChain();
+    const ProgramChain & programChain() const;
+
     void addProgramChangeActionListener(juce::ActionListener * listener);
     void removeProgramChangeActionListener(juce::ActionListener * listener);
 
@@ -57,16 +79,26 @@ class PluginProcessor : public juce::AudioProcessor, public ProgramManager::List
     // The params tree holds values that are shared between us and the host.
     juce::AudioProcessorValueTreeState _params;
     bool                               _transportRunning = false;
+    std::atomic<bool>                  _flushNotes { false };
     std::atomic<float> *               _bpm              = nullptr;
     double                             _sampleRate       = 0.0;
-    double                             _now              = 0.0;
+    TickClock                          _clock;
     ProgramManager                     _programManager;
+    ProgramChain                       _programChain;
     juce::ActionBroadcaster            _programChangeActionBroadcaster;
     int                                _hostProgram = 0;
 
     juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout() const;
     void programManagerProgramChanged(int value) override;
     void programManagerListChanged() override;
+    void programManagerStateWillLoad(const ProgramManager::SnapshotPtr &snapshot) override;
+    void programManagerStateLoaded() override;
+    void queueProgramSwitch(const ProgramManager::SnapshotPtr &snapshot, TickClock::Tick period, TickClock::Tick notBefore, uint32_t id) override;
+    void cancelProgramSwitch() override;
+    uint32_t lastProgramSwitch() const override;
+    TickClock::Tick lastProgramSwitchTick() const override;
+    TickClock::Tick patternLength() const override;
+    TickClock::Tick barLength() const override;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PluginProcessor)
 };
@@ -87,6 +119,14 @@ inline const ProgramManager & PluginProcessor::programManager() const {
     return _programManager;
 }
 
+inline ProgramChain & PluginProcessor::programChain() {
+    return _programChain;
+}
+
+inline const ProgramChain & PluginProcessor::programChain() const {
+    return _programChain;
+}
+
 inline void PluginProcessor::addProgramChangeActionListener(juce::ActionListener * listener) {
     _programChangeActionBroadcaster.addActionListener(listener);
     return;
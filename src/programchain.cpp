@@ -0,0 +1,234 @@
+#include <limits>
+#include "programchain.h"
+
+static const juce::Identifier ProgramChainIdentifier("ProgramChain");
+static const juce::Identifier LinkIdentifier("Link");
+static const juce::Identifier QuantizeIdentifier("quantize");
+static const juce::Identifier ProgramIdentifier("program");
+static const juce::Identifier BarsIdentifier("bars");
+
+// How often to look for a switch the engine has made.
+static const int pollIntervalMs = 10;
+// Queues for the next boundary, wherever the engine is.
+static const TickClock::Tick nextBoundary = std::numeric_limits<TickClock::Tick>::min();
+
+const juce::StringArray &ProgramChain::quantizeNames() {
+    static juce::StringArray _quantizeNames = {
+        "Off",
+        "Next Bar",
+        "Next Pattern"
+    };
+    return _quantizeNames;
+}
+
+ProgramChain::ProgramChain(ProgramManager &programs, Engine &engine) :
+    _programs(programs),
+    _engine(engine)
+{
+    _programs.addListener(this);
+}
+
+ProgramChain::~ProgramChain() {
+    stopTimer();
+    _programs.removeListener(this);
+}
+
+juce::ValueTree ProgramChain::chainState() {
+    return _programs.appState().getOrCreateChildWithName(ProgramChainIdentifier, nullptr);
+}
+
+juce::ValueTree ProgramChain::chainState() const {
+    return _programs.appState().getChildWithName(ProgramChainIdentifier);
+}
+
+ProgramChain::Quantize ProgramChain::quantize() const {
+    int ret = chainState().getProperty(QuantizeIdentifier, (int)QuantizeOff);
+    return (Quantize)juce::jlimit((int)QuantizeOff, (int)QuantizePattern, ret);
+}
+
+void ProgramChain::setQuantize(Quantize quantize) {
+    chainState().setProperty(QuantizeIdentifier, (int)quantize, nullptr);
+    return;
+}
+
+juce::Array<ProgramChain::Link> ProgramChain::links() const {
+    juce::Array<Link> ret;
+    juce::ValueTree state = chainState();
+    for(int i = 0; i < state.getNumChildren(); i++) {
+        juce::ValueTree child = state.getChild(i);
+        if(!child.hasType(LinkIdentifier)) continue;
+        Link link;
+        link.program = _programs.findProgram(child.getProperty(ProgramIdentifier).toString());
+        if(link.program < 0) continue;
+        link.bars = juce::jlimit(1, maxBars, (int)child.getProperty(BarsIdentifier, 1));
+        ret.add(link);
+    }
+    return ret;
+}
+
+void ProgramChain::addLink(int program, int bars) {
+    if(!_programs.indexIsValid(program)) return;
+    // Programs are kept by ID, so the chain doesn't care if others are deleted.
+    juce::ValueTree link(LinkIdentifier);
+    link.setProperty(ProgramIdentifier, _programs.programID(program), nullptr);
+    link.setProperty(BarsIdentifier, juce::jlimit(1, maxBars, bars), nullptr);
+    chainState().appendChild(link, nullptr);
+    return;
+}
+
+void ProgramChain::clearLinks() {
+    stop();
+    chainState().removeAllChildren(nullptr);
+    return;
+}
+
+int ProgramChain::queuedProgram() const {
+    return _queued ? _programs.findProgram(_queuedID) : -1;
+}
+
+TickClock::Tick ProgramChain::quantizePeriod() const {
+    if(quantize() == QuantizePattern) return std::max(_engine.barLength(), _engine.patternLength());
+    return _engine.barLength();
+}
+
+void ProgramChain::play() {
+    if(links().isEmpty()) return;
+    juce::Logger::writeToLog("Play program chain");
+    _playing = true;
+    // Without quantize the chain still has to start on a bar, so it can count them.
+    queueLink(0, nextBoundary);
+    return;
+}
+
+void ProgramChain::stop() {
+    if(_playing) juce::Logger::writeToLog("Stop program chain");
+    _playing = false;
+    _position = -1;
+    cancel();
+    return;
+}
+
+void ProgramChain::queueProgram(int index) {
+    if(!_programs.indexIsValid(index)) return;
+    stop();
+    if(index == _programs.currentProgram()) return;
+    if(quantize() == QuantizeOff) {
+        _changing = true;
+        _programs.changeProgram(index);
+        _changing = false;
+        return;
+    }
+    juce::Logger::writeToLog(juce::String::formatted("Queue program %d", index));
+    queueSwitch(index, quantizePeriod(), nextBoundary);
+    return;
+}
+
+// Queues the link, or the first one if we've gone past the end.  The first
+// link goes on the quantize boundary, the rest follow on from the last.
+bool ProgramChain::queueLink(int position, TickClock::Tick notBefore) {
+    juce::Array<Link> chain = links();
+    if(chain.isEmpty()) {
+        stop();
+        return false;
+    }
+    _position = position % chain.size();
+    TickClock::Tick period = notBefore == nextBoundary ? quantizePeriod() : _engine.barLength();
+    queueSwitch(chain[_position].program, period, notBefore);
+    // So the link after this one is ready when it's queued.
+    _programs.prepareSnapshot(chain[(_position + 1) % chain.size()].program);
+    return true;
+}
+
+void ProgramChain::queueSwitch(int program, TickClock::Tick period, TickClock::Tick notBefore) {
+    checkSwitched();
+    // If the program is already playing, the switch just marks the boundary.
+    // If its snapshot isn't ready, the switch goes in without it for now.
+    ProgramManager::SnapshotPtr snapshot;
+    if(program != _programs.currentProgram()) snapshot = _programs.snapshot(program);
+    if(++_switchID == 0) _switchID = 1;
+    _queuedID = _programs.programID(program);
+    _queued = true;
+    _queuedSnapshot = snapshot != nullptr || program == _programs.currentProgram();
+    _queuedPeriod = period;
+    _queuedNotBefore = notBefore;
+    _engine.queueProgramSwitch(snapshot, period, notBefore, _switchID);
+    startTimer(pollIntervalMs);
+    return;
+}
+
+void ProgramChain::cancel() {
+    // A switch that's already been made is kept.
+    checkSwitched();
+    if(_queued) {
+        _engine.cancelProgramSwitch();
+        _queued = false;
+        _queuedID.clear();
+    }
+    stopTimer();
+    return;
+}
+
+// Loads the parameters for the program the engine has switched to, if it
+// has, and queues the next link if the chain is playing.
+void ProgramChain::checkSwitched() {
+    if(!_queued || _engine.lastProgramSwitch() != _switchID) return;
+    _queued = false;
+    int program = _programs.findProgram(_queuedID);
+    _queuedID.clear();
+    if(program >= 0 && program != _programs.currentProgram()) {
+        _changing = true;
+        _programs.changeProgram(program);
+        _changing = false;
+    }
+    if(_playing) {
+        juce::Array<Link> chain = links();
+        int bars = _position >= 0 && _position < chain.size() ? chain[_position].bars : 1;
+        queueLink(_position + 1, _engine.lastProgramSwitchTick() + bars * _engine.barLength());
+    }
+    if(!_queued) stopTimer();
+    return;
+}
+
+// Hands the engine the snapshot for the queued switch once it's been built.
+// Queued again under the same ID, so if the switch has already been made
+// without it the engine ignores it.
+void ProgramChain::checkSnapshot() {
+    if(!_queued || _queuedSnapshot) return;
+    int program = _programs.findProgram(_queuedID);
+    ProgramManager::SnapshotPtr snapshot = program >= 0 ? _programs.snapshot(program) : nullptr;
+    if(snapshot == nullptr) return;
+    _queuedSnapshot = true;
+    _engine.queueProgramSwitch(snapshot, _queuedPeriod, _queuedNotBefore, _switchID);
+    return;
+}
+
+void ProgramChain::timerCallback() {
+    checkSwitched();
+    checkSnapshot();
+    return;
+}
+
+void ProgramChain::actionListenerCallback(const juce::String &message) {
+    juce::StringArray tokens = juce::StringArray::fromTokens(message, false);
+    if(tokens.size() < 2) return;
+    if(tokens[0] == "ProgramChange") {
+        int val = tokens[1].getIntValue();
+        if(val < 0) val = 0;
+        if(val >= _programs.programCount()) val = _programs.programCount() - 1;
+        queueProgram(val);
+    }
+    return;
+}
+
+void ProgramChain::programManagerProgramChanged(int value) {
+    juce::ignoreUnused(value);
+    // Changed from somewhere else, which takes over from the chain.
+    if(!_changing) stop();
+    return;
+}
+
+void ProgramChain::programManagerListChanged() {
+    // The program we've queued may have been deleted, or a new state loaded.
+    if(_queued && _programs.findProgram(_queuedID) < 0) stop();
+    return;
+}
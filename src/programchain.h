@@ -0,0 +1,112 @@
+#ifndef _PROGRAMCHAIN_H_
+#define _PROGRAMCHAIN_H_
+#pragma once
+
+#include <juce_events/juce_events.h>
+#include "programmanager.h"
+#include "tickclock.h"
+
+// Song mode.  Program changes from the host are queued and land on the next
+// bar or pattern boundary instead of whenever the message thread gets to
+// them.  A chain of programs, each played for a number of bars, can also be
+// played through in a loop.
+//
+// The engine is handed the next program's snapshot as soon as it's known and
+// switches to it on the boundary by itself.  The parameters are loaded
+// afterwards, the same as any other program change, once we've seen that the
+// switch was made.  The chain and the quantize setting are kept in the app
+// state, so they're saved with everything else.
+class ProgramChain :
+    public juce::ActionListener,
+    public ProgramManager::Listener,
+    private juce::Timer
+{
+    public:
+        enum Quantize {
+            QuantizeOff             = 0,        // Change straight away
+            QuantizeBar             = 1,
+            QuantizePattern         = 2         // The longest pattern playing
+        };
+
+        struct Link {
+            int         program = 0;
+            int         bars = 1;
+        };
+
+        // What the chain needs from the engine.
+        class Engine {
+            public:
+                virtual ~Engine() { };
+                // Switches the engine to the snapshot on the first multiple of
+                // period ticks at or after notBefore.  Without a snapshot the
+                // switch only marks the tick.  Replaces anything queued.
+                virtual void queueProgramSwitch(const ProgramManager::SnapshotPtr &snapshot, TickClock::Tick period, TickClock::Tick notBefore, uint32_t id) = 0;
+                virtual void cancelProgramSwitch() = 0;
+                // ID of the last queued switch made, and the tick it was made on.
+                virtual uint32_t lastProgramSwitch() const = 0;
+                virtual TickClock::Tick lastProgramSwitchTick() const = 0;
+                // Length of the longest pattern playing.
+                virtual TickClock::Tick patternLength() const = 0;
+                // Length of a bar in the current time signature.
+                virtual TickClock::Tick barLength() const = 0;
+        };
+
+        static constexpr int maxBars = 64;
+
+        static const juce::StringArray &quantizeNames();
+
+        ProgramChain(ProgramManager &programs, Engine &engine);
+        ~ProgramChain() override;
+
+        Quantize quantize() const;
+        void setQuantize(Quantize quantize);
+
+        // Links to programs that have been deleted are left out.
+        juce::Array<Link> links() const;
+        void addLink(int program, int bars);
+        void clearLinks();
+
+        bool isPlaying() const;
+        // Starts from the first link on the next boundary, and loops.
+        void play();
+        void stop();
+
+        // Changes to the program on the next boundary, or straight away if
+        // quantize is off.  Stops the chain.
+        void queueProgram(int index);
+        // Program waiting for its boundary, or -1.
+        int queuedProgram() const;
+
+    private:
+        ProgramManager      &_programs;
+        Engine              &_engine;
+        bool                _playing = false;
+        int                 _position = -1;         // Link that's playing or queued
+        juce::String        _queuedID;              // Program queued on the engine
+        bool                _queued = false;
+        bool                _queuedSnapshot = false; // The engine has the snapshot for it
+        TickClock::Tick     _queuedPeriod = 0;
+        TickClock::Tick     _queuedNotBefore = 0;
+        uint32_t            _switchID = 0;          // ID of the queued switch
+        bool                _changing = false;      // We're changing the program
+
+        juce::ValueTree chainState();
+        juce::ValueTree chainState() const;
+        TickClock::Tick quantizePeriod() const;
+        void queueSwitch(int program, TickClock::Tick period, TickClock::Tick notBefore);
+        void cancel();
+        bool queueLink(int position, TickClock::Tick notBefore);
+        void checkSwitched();
+        void checkSnapshot();
+
+        void actionListenerCallback(const juce::String &message) override;
+        void programManagerProgramChanged(int value) override;
+        void programManagerListChanged() override;
+        void timerCallback() override;
+};
+
+inline bool ProgramChain::isPlaying() const {
+    return _playing;
+}
+
+#endif
@@ -1,8 +1,13 @@
+#include <cmath>
+#include <limits>
+#include <vector>
 #include "programmanager.h"
 #include "buildinfo.h"
 
-#define STATE_NAME      "HowardLogicState"
-#define STATE_VERSION   1
+#define STATE_NAME              "HowardLogicState"
+#define STATE_VERSION           1
+#define STATE_BINARY_MAGIC      0x32534c48u     // "HLS2"
+#define STATE_BINARY_VERSION    4
 
 static const juce::Identifier NodeIDIdentifier("NodeID");
 static const juce::Identifier NameIdentifier("Name");
@@ -12,6 +17,11 @@ static const juce::Identifier ProgramStateIdentifier("ProgramState");
 static const juce::Identifier PresetNameIdentifier("PresetName");
 static const juce::Identifier PresetAuthorIdentifer("PresetAuthor");
 static const juce::Identifier PresetDescIdentifier("PresetDesc");
+// The parameter state is made by the value tree state, with a PARAM child
+// holding the ID and value of each parameter.
+static const juce::Identifier ParamIdentifier("PARAM");
+static const juce::Identifier IDIdentifier("id");
+static const juce::Identifier ValueIdentifier("value");
 
 juce::File ProgramManager::userStateStoragePath() {
     auto ret = juce::File::getSpecialLocation(juce::File::userApplicationDataDirectory).getChildFile("SickBeatBetty");
@@ -65,17 +75,82 @@ ProgramManager::ProgramManager(const juce::String &appName, juce::AudioProcessor
 
 ProgramManager::~ProgramManager()
 {
+    for(auto *param : _vts.processor.getParameters()) param->removeListener(this);
+    // The builder belongs to whoever owns us, so nothing can still be using it.
+    for(auto &i : _building) i.wait();
+}
 
+void ProgramManager::setSnapshotBuilder(SnapshotBuilder builder) {
+    _snapshotBuilder = std::move(builder);
+    return;
 }
 
 void ProgramManager::init() {
+    // The defaults that programs are stored as deltas against, and the
+    // values to check for changes when they're stored.
+    const juce::Array<juce::AudioProcessorParameter *> &params = _vts.processor.getParameters();
+    _params.resize((size_t)params.size());
+    _dirty = std::vector<std::atomic<uint64_t>>(((size_t)params.size() + 63) / 64);
+    for(int i = 0; i < params.size(); i++) {
+        auto *ranged = dynamic_cast<juce::RangedAudioParameter *>(params[i]);
+        if(ranged == nullptr) continue;
+        Param &param = _params[(size_t)i];
+        param.id = ranged->getParameterID();
+        param.defaultValue = ranged->convertFrom0to1(ranged->getDefaultValue());
+        param.value = _vts.getRawParameterValue(param.id);
+        param.synced = param.value != nullptr ? param.value->load() : param.defaultValue;
+        _paramIndex.set(param.id, i);
+        ranged->addListener(this);
+    }
     _appState.setProperty(AppNameIdentifier, _appName, nullptr);
     _appState.setProperty(NodeIDIdentifier, juce::Uuid().toString(), nullptr);
     _programState.setProperty(NameIdentifier, "Default Program", nullptr);
     _programState.setProperty(NodeIDIdentifier, juce::Uuid().toString(), nullptr);
-    // We should always have one program.
-    _programStateArray.add(_programState);
-    _vtsStateArray.add(_vts.copyState());
+    // We should always have one program.  The stored state is only replaced
+    // when the program's changed, so it can't be the one we change.
+    _programStateArray.add(_programState.createCopy());
+    _vtsStateArray.add(deltaState(_vts.copyState()));
+    return;
+}
+
+ProgramManager::SnapshotFuture ProgramManager::buildSnapshot(const juce::ValueTree &vtsState) {
+    auto task = std::make_shared<std::packaged_task<SnapshotPtr()>>(
+        [builder = _snapshotBuilder, vtsState]() { return builder(vtsState); }
+    );
+    SnapshotFuture ret = task->get_future().share();
+    _snapshotPool->pool.addJob([task]() { (*task)(); });
+    // Keep track of it until it's done, even if it drops out of the cache.
+    _building.removeIf([](const SnapshotFuture &i) {
+        return i.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    });
+    _building.add(ret);
+    return ret;
+}
+
+ProgramManager::SnapshotPtr ProgramManager::snapshot(int index) {
+    if(!indexIsValid(index) || !_snapshotBuilder) return SnapshotPtr();
+    const juce::ValueTree &delta = _vtsStateArray.getReference(index);
+    CachedSnapshot entry;
+    for(int i = 0; i < _snapshotCache.size(); i++) {
+        if(_snapshotCache.getReference(i).delta != delta) continue;
+        entry = _snapshotCache.removeAndReturn(i);
+        break;
+    }
+    bool ready = entry.snapshot.valid() && entry.snapshot.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    if(!entry.snapshot.valid() || (ready && entry.snapshot.get() != nullptr && !entry.snapshot.get()->isCurrent())) {
+        entry.delta = delta;
+        entry.snapshot = buildSnapshot(delta);
+        ready = false;
+    }
+    // Anything that drops off the end while it's building is still waited
+    // for in the destructor.
+    _snapshotCache.insert(0, entry);
+    if(_snapshotCache.size() > snapshotCacheSize) _snapshotCache.removeLast();
+    return ready ? entry.snapshot.get() : SnapshotPtr();
+}
+
+void ProgramManager::prepareSnapshot(int index) {
+    snapshot(index);
     return;
 }
 
@@ -95,9 +170,14 @@ void ProgramManager::changeProgram(int index) {
         return;
     }
     juce::Logger::writeToLog(juce::String::formatted("Change program %d", index));
+    // The engine can switch to the snapshot straight away, so it doesn't
+    // have to wait for the current state to be saved.
+    SnapshotPtr next = snapshot(index);
+    _listenerList.call([&next](Listener &l) { l.programManagerStateWillLoad(next); });
     syncToArray(); // Write the current state of things into the program array.
     _currentProgram = index;
-    syncFromArray(); // Load the newly selected index from the program array.
+    syncFromArray(false); // Load the newly selected index from the program array.
+    _listenerList.call([](Listener &l) { l.programManagerStateLoaded(); });
     _listenerList.call(
         [this](Listener &l) { l.programManagerProgramChanged(_currentProgram); }
     );
@@ -109,6 +189,19 @@ juce::String ProgramManager::programName(int index) const {
     return programStateForIndex(index).getProperty(NameIdentifier).toString();
 }
 
+juce::String ProgramManager::programID(int index) const {
+    if(!indexIsValid(index)) return juce::String();
+    return programStateForIndex(index).getProperty(NodeIDIdentifier).toString();
+}
+
+int ProgramManager::findProgram(const juce::String &id) const {
+    if(id.isEmpty()) return -1;
+    for(int i = 0; i < programCount(); i++) {
+        if(programID(i) == id) return i;
+    }
+    return -1;
+}
+
 void ProgramManager::renameProgram(int index, const juce::String &name) {
     if(!indexIsValid(index)) {
         juce::Logger::writeToLog(juce::String::formatted("Failed to rename program %d", index));
@@ -129,14 +222,11 @@ void ProgramManager::renameProgram(int index, const juce::String &name) {
 
 void ProgramManager::duplicateProgram(int indexToCopy) {
     if(!indexIsValid(indexToCopy)) return;
-    juce::ValueTree programState, vtsState;
-    if(indexToCopy == _currentProgram) {
-        programState = _programState.createCopy();
-        vtsState = _vts.copyState();
-    } else {
-        programState = _programStateArray[indexToCopy].createCopy();
-        vtsState = _vtsStateArray[indexToCopy].createCopy();
-    }
+    // The copy shares the parameters and the snapshot until one of them is
+    // edited, so only the small program state is copied.
+    if(indexToCopy == _currentProgram) syncToArray();
+    juce::ValueTree programState = programStateForIndex(indexToCopy).createCopy();
+    juce::ValueTree vtsState = _vtsStateArray[indexToCopy];
     juce::String name = programState.getProperty(NameIdentifier).toString();
     name += " Copy";
     programState.setProperty(NameIdentifier, name, nullptr);
@@ -180,18 +270,110 @@ void ProgramManager::overwriteProgram(int indexToCopy, int indexToOverwrite) {
     return;
 }
 
+// Only what's changed since the last sync is written back.  The stored
+// delta is replaced rather than changed, as other programs may share it.
 void ProgramManager::syncToArray() {
-    _programStateArray.set(_currentProgram, _programState.createCopy());
-    _vtsStateArray.set(_currentProgram, _vts.copyState());
+    if(!_programStateArray[_currentProgram].isEquivalentTo(_programState)) {
+        _programStateArray.set(_currentProgram, _programState.createCopy());
+    }
+    juce::Array<int> changed;
+    for(size_t w = 0; w < _dirty.size(); w++) {
+        uint64_t bits = _dirty[w].exchange(0, std::memory_order_acquire);
+        for(int b = 0; bits != 0; b++, bits >>= 1) {
+            if((bits & 1) == 0) continue;
+            Param &param = _params[w * 64 + (size_t)b];
+            if(param.value == nullptr) continue;
+            float value = param.value->load(std::memory_order_relaxed);
+            if(value == param.synced) continue;
+            param.synced = value;
+            changed.add((int)(w * 64) + b);
+        }
+    }
+    if(changed.isEmpty()) return;
+
+    juce::ValueTree delta = _vtsStateArray[_currentProgram].createCopy();
+    for(int index : changed) {
+        const Param &param = _params[(size_t)index];
+        juce::ValueTree child = delta.getChildWithProperty(IDIdentifier, param.id);
+        if(param.synced == param.defaultValue) {
+            if(child.isValid()) delta.removeChild(child, nullptr);
+            continue;
+        }
+        if(!child.isValid()) {
+            child = juce::ValueTree(ParamIdentifier);
+            child.setProperty(IDIdentifier, param.id, nullptr);
+            delta.appendChild(child, nullptr);
+        }
+        child.setProperty(ValueIdentifier, param.synced, nullptr);
+    }
+    _vtsStateArray.set(_currentProgram, delta);
     return;
 }
 
-void ProgramManager::syncFromArray() {
+// Unless notify is false, in which case the caller tells the listeners.
+void ProgramManager::syncFromArray(bool notify) {
     _programState.copyPropertiesAndChildrenFrom(_programStateArray[_currentProgram], nullptr);
-    _vts.replaceState(_vtsStateArray[_currentProgram]);
+    SnapshotPtr snapshot = notify ? this->snapshot(_currentProgram) : SnapshotPtr();
+    if(notify) _listenerList.call([&snapshot](Listener &l) { l.programManagerStateWillLoad(snapshot); });
+    // Anything that changes from here on gets written back, including the
+    // loading itself, so nothing that lands while we're loading is lost.
+    for(auto &i : _dirty) i.store(0, std::memory_order_relaxed);
+    // The values the program has stored, to check for changes against.
+    const juce::ValueTree &delta = _vtsStateArray.getReference(_currentProgram);
+    for(auto &param : _params) param.synced = param.defaultValue;
+    for(int i = 0; i < delta.getNumChildren(); i++) {
+        juce::ValueTree child = delta.getChild(i);
+        juce::String id = child.getProperty(IDIdentifier).toString();
+        if(child.hasType(ParamIdentifier) && _paramIndex.contains(id)) {
+            _params[(size_t)_paramIndex[id]].synced = (float)child.getProperty(ValueIdentifier);
+        }
+    }
+    _vts.replaceState(fullState(delta));
+    if(notify) _listenerList.call([](Listener &l) { l.programManagerStateLoaded(); });
     return;
 }
 
+juce::ValueTree ProgramManager::deltaState(const juce::ValueTree &vtsState) const {
+    juce::ValueTree ret(vtsState.getType());
+    ret.copyPropertiesFrom(vtsState, nullptr);
+    for(int i = 0; i < vtsState.getNumChildren(); i++) {
+        juce::ValueTree child = vtsState.getChild(i);
+        if(child.hasType(ParamIdentifier)) {
+            // Parameters we don't know about are kept, like the parameters would.
+            juce::String id = child.getProperty(IDIdentifier).toString();
+            if(_paramIndex.contains(id) && (float)child.getProperty(ValueIdentifier) == _params[(size_t)_paramIndex[id]].defaultValue) continue;
+        }
+        ret.appendChild(child.createCopy(), nullptr);
+    }
+    return ret;
+}
+
+juce::ValueTree ProgramManager::fullState(const juce::ValueTree &delta) const {
+    std::vector<float> values(_params.size());
+    for(size_t i = 0; i < _params.size(); i++) values[i] = _params[i].defaultValue;
+    juce::ValueTree ret(delta.getType());
+    ret.copyPropertiesFrom(delta, nullptr);
+    juce::Array<juce::ValueTree> extra;
+    for(int i = 0; i < delta.getNumChildren(); i++) {
+        juce::ValueTree child = delta.getChild(i);
+        juce::String id = child.getProperty(IDIdentifier).toString();
+        if(child.hasType(ParamIdentifier) && _paramIndex.contains(id)) {
+            values[(size_t)_paramIndex[id]] = (float)child.getProperty(ValueIdentifier);
+        } else {
+            extra.add(child.createCopy());
+        }
+    }
+    for(size_t i = 0; i < _params.size(); i++) {
+        if(_params[i].id.isEmpty()) continue;
+        juce::ValueTree child(ParamIdentifier);
+        child.setProperty(IDIdentifier, _params[i].id, nullptr);
+        child.setProperty(ValueIdentifier, values[i], nullptr);
+        ret.appendChild(child, nullptr);
+    }
+    for(auto &child : extra) ret.appendChild(child, nullptr);
+    return ret;
+}
+
 ProgramManager::StateXML ProgramManager::getStateXML() {
     syncToArray();
     const BuildInfo *buildInfo = getBuildInfo();
@@ -224,11 +406,12 @@ ProgramManager::StateXML ProgramManager::getStateXML() {
         programStatesNode->addChildElement(item.release());
     }
 
-    // Add the param states array
+    // Add the param states array.  Presets have every value, not just the
+    // changes, so they load the same whatever the defaults are by then.
     auto paramStatesNode = ret->createNewChildElement("ParamStates");
     paramStatesNode->setAttribute("count", _vtsStateArray.size());
     for(int i = 0; i < _vtsStateArray.size(); i++) {
-        auto item = _vtsStateArray.getReference(i).createXml();
+        auto item = fullState(_vtsStateArray.getReference(i)).createXml();
         item->setAttribute("index", i);
         paramStatesNode->addChildElement(item.release());
     }
@@ -274,13 +457,6 @@ bool ProgramManager::setStateFromXMLv1(const StateXML &xml) {
         juce::Logger::writeToLog("State XML failed to parse AppState node");
         return false;
     }
-    if(appState.getProperty(AppNameIdentifier) != _appState.getProperty(AppNameIdentifier)) {
-        juce::Logger::writeToLog("State XML appName is wrong, expected '" + 
-            _appState.getProperty(AppNameIdentifier).toString() + 
-            "' got '" +
-            appState.getProperty(AppNameIdentifier).toString());
-        return false;
-    }
 
     auto programStatesNode = xml->getChildByName("ProgramStates");
     if(programStatesNode == nullptr) {
@@ -296,56 +472,285 @@ bool ProgramManager::setStateFromXMLv1(const StateXML &xml) {
     }
     if(!loadValueTreeArrayXML(vtsStateArray, *paramStatesNode)) return false;
 
-    // Some final checks to make sure the state is well formed.
+    return loadState(appState, programStateArray, vtsStateArray, currentProgram);
+}
+
+bool ProgramManager::setStateFromXML(const StateXML &xml) {
+    if(xml->getTagName() != STATE_NAME) {
+        juce::Logger::writeToLog(juce::String("State XML tag name is incorrect. Expected ") + STATE_NAME + ", got " + xml->getTagName());
+        return false;
+    }
+
+    int stateVersion = xml->getIntAttribute("stateVersion", -1);
+    bool ret = false;
+    switch(stateVersion) {
+        case 1: ret = setStateFromXMLv1(xml); break;
+        default:
+            juce::Logger::writeToLog(juce::String::formatted("State XML version %d isn't supported", stateVersion));
+            ret = false;
+            break;
+    }
+    return ret;
+}
+
+// Checks the state is well formed and swaps it in.
+bool ProgramManager::loadState(const juce::ValueTree &appState, const juce::Array<juce::ValueTree> &programStateArray,
+    const juce::Array<juce::ValueTree> &vtsStateArray, int currentProgram) {
+    if(appState.getProperty(AppNameIdentifier) != _appState.getProperty(AppNameIdentifier)) {
+        juce::Logger::writeToLog("State appName is wrong, expected '" + 
+            _appState.getProperty(AppNameIdentifier).toString() + 
+            "' got '" +
+            appState.getProperty(AppNameIdentifier).toString());
+        return false;
+    }
+
     if(vtsStateArray.size() != programStateArray.size()) {
-        juce::Logger::writeToLog("State XML param and program arrays differ " +
+        juce::Logger::writeToLog("State param and program arrays differ " +
             juce::String(vtsStateArray.size()) + " vs " + juce::String(programStateArray.size()));
         return false;
     }
 
     if(vtsStateArray.size() < 1) {
-        juce::Logger::writeToLog("State XML doesn't have at least one entry");
+        juce::Logger::writeToLog("State doesn't have at least one entry");
         return false;
     }
 
     if(currentProgram < 0 || currentProgram >= vtsStateArray.size()) {
-        juce::Logger::writeToLog("State XML currentProgram is out of bounds " + juce::String(currentProgram));
+        juce::Logger::writeToLog("State currentProgram is out of bounds " + juce::String(currentProgram));
         currentProgram = 0; // Failback to a safe value that we know exists.
     }
 
+    // Older states have every parameter in every program.  Snapshots are
+    // only built as the programs are needed.
+    juce::Array<juce::ValueTree> deltaArray;
+    for(int i = 0; i < vtsStateArray.size(); i++) {
+        deltaArray.add(deltaState(vtsStateArray.getReference(i)));
+    }
+
     // Nothing left to do but swap the state out.
     _currentProgram = currentProgram;
     _programStateArray = programStateArray;
-    _vtsStateArray = vtsStateArray;
+    _vtsStateArray = deltaArray;
+    _snapshotCache.clear();
     _appState = appState;
     syncFromArray();
+    _listenerList.call([](Listener &l) {
+        l.programManagerListChanged();
+        l.programManagerCurrentProgramNamedChanged();
+    });
     return true;
 }
 
-bool ProgramManager::setStateFromXML(const StateXML &xml) {
-    if(xml->getTagName() != STATE_NAME) {
-        juce::Logger::writeToLog(juce::String("State XML tag name is incorrect. Expected ") + STATE_NAME + ", got " + xml->getTagName());
-        return false;
+// The binary layout, all little endian:
+//   magic, stateVersion
+//   currentProgram, build version and repoident (just for debug)
+//   app state tree
+//   program count, then each program's state tree
+//   param state tree type, param count, then each param ID and its default
+//   as a float, NaN for params we don't know about
+//   each program's params that aren't at their defaults, as a count then
+//   pairs of the index into the IDs and the value as a float
+// Version 3 had no defaults, and only the IDs some program used.  Version 2
+// had a float for every param in every program instead, NaN if the program
+// didn't have it.
+void ProgramManager::getStateBinary(juce::MemoryBlock &dest) {
+    syncToArray();
+    // Every param goes in the table with its default, so a param a program
+    // leaves out still means the default it was saved with if the default
+    // changes later.
+    typedef std::pair<int, float> Entry;
+    juce::StringArray ids;
+    std::vector<float> defaults;
+    juce::HashMap<juce::String, int> columns;
+    for(auto &param : _params) {
+        if(param.id.isEmpty()) continue;
+        columns.set(param.id, ids.size());
+        ids.add(param.id);
+        defaults.push_back(param.defaultValue);
+    }
+    std::vector<std::vector<Entry>> rows((size_t)_vtsStateArray.size());
+    size_t entries = 0;
+    for(int i = 0; i < _vtsStateArray.size(); i++) {
+        const juce::ValueTree &vtsState = _vtsStateArray.getReference(i);
+        std::vector<Entry> &row = rows[(size_t)i];
+        for(int j = 0; j < vtsState.getNumChildren(); j++) {
+            juce::ValueTree child = vtsState.getChild(j);
+            if(!child.hasType(ParamIdentifier)) continue;
+            juce::String id = child.getProperty(IDIdentifier).toString();
+            if(!columns.contains(id)) {
+                columns.set(id, ids.size());
+                ids.add(id);
+                defaults.push_back(std::numeric_limits<float>::quiet_NaN());
+            }
+            row.push_back({ columns[id], (float)child.getProperty(ValueIdentifier) });
+        }
+        entries += row.size();
     }
 
-    int stateVersion = xml->getIntAttribute("stateVersion", -1);
+    const BuildInfo *buildInfo = getBuildInfo();
+    juce::MemoryOutputStream stream(dest, false);
+    stream.preallocate(entries * 8 + (size_t)ids.size() * 32 + 4096);
+    stream.writeInt((int)STATE_BINARY_MAGIC);
+    stream.writeInt(STATE_BINARY_VERSION);
+    stream.writeCompressedInt(_currentProgram);
+    stream.writeString(buildInfo->version);
+    stream.writeString(buildInfo->repoident);
+    _appState.writeToStream(stream);
+    stream.writeCompressedInt(_programStateArray.size());
+    for(int i = 0; i < _programStateArray.size(); i++) {
+        _programStateArray.getReference(i).writeToStream(stream);
+    }
+    stream.writeString(_vtsStateArray.getReference(_currentProgram).getType().toString());
+    stream.writeCompressedInt(ids.size());
+    for(int i = 0; i < ids.size(); i++) {
+        stream.writeString(ids[i]);
+        stream.writeFloat(defaults[(size_t)i]);
+    }
+    for(auto &row : rows) {
+        stream.writeCompressedInt((int)row.size());
+        for(auto &entry : row) {
+            stream.writeCompressedInt(entry.first);
+            stream.writeFloat(entry.second);
+        }
+    }
+    stream.flush();
+    return;
+}
+
+bool ProgramManager::isStateBinary(const void *data, size_t size) {
+    if(data == nullptr || size < 8) return false;
+    juce::MemoryInputStream stream(data, size, false);
+    return (juce::uint32)stream.readInt() == STATE_BINARY_MAGIC;
+}
+
+bool ProgramManager::setStateFromBinary(const void *data, size_t size) {
+    if(!isStateBinary(data, size)) {
+        juce::Logger::writeToLog("State data isn't binary state");
+        return false;
+    }
+    juce::MemoryInputStream stream(data, size, false);
+    stream.readInt();
+    int stateVersion = stream.readInt();
     bool ret = false;
     switch(stateVersion) {
-        case 1: ret = setStateFromXMLv1(xml); break;
+        case 2:
+        case 3:
+        case 4: ret = setStateFromBinaryV2(stream, stateVersion); break;
         default:
-            juce::Logger::writeToLog(juce::String::formatted("State XML version %d isn't supported", stateVersion));
+            juce::Logger::writeToLog(juce::String::formatted("State binary version %d isn't supported", stateVersion));
             ret = false;
             break;
     }
-    if(ret) {
-        _listenerList.call([](Listener &l) {
-            l.programManagerListChanged();
-            l.programManagerCurrentProgramNamedChanged();
-        });
-    }
     return ret;
 }
 
+// Versions 2 to 4 only differ in how the param values are packed.
+bool ProgramManager::setStateFromBinaryV2(juce::InputStream &stream, int stateVersion) {
+    juce::Array<juce::ValueTree> programStateArray;
+    juce::Array<juce::ValueTree> vtsStateArray;
+    int currentProgram = stream.readCompressedInt();
+    juce::String version = stream.readString();
+    juce::String repoident = stream.readString();
+    juce::Logger::writeToLog("Loading state saved by " + version + " " + repoident);
+
+    juce::ValueTree appState = juce::ValueTree::readFromStream(stream);
+    if(!appState.isValid()) {
+        juce::Logger::writeToLog("State binary failed to read the app state");
+        return false;
+    }
+
+    int programCount = stream.readCompressedInt();
+    if(programCount < 1 || programCount > stream.getNumBytesRemaining()) {
+        juce::Logger::writeToLog("State binary has an invalid program count: " + juce::String(programCount));
+        return false;
+    }
+    for(int i = 0; i < programCount; i++) {
+        juce::ValueTree programState = juce::ValueTree::readFromStream(stream);
+        if(!programState.isValid()) {
+            juce::Logger::writeToLog("State binary failed to read program state " + juce::String(i));
+            return false;
+        }
+        programStateArray.add(programState);
+    }
+
+    juce::Identifier vtsType(stream.readString());
+    int paramCount = stream.readCompressedInt();
+    if(paramCount < 0 || paramCount > stream.getNumBytesRemaining()) {
+        juce::Logger::writeToLog("State binary has an invalid param count: " + juce::String(paramCount));
+        return false;
+    }
+    // The params whose defaults have changed since the state was saved.  A
+    // program that leaves one out gets the default it was saved with.
+    juce::StringArray ids;
+    juce::Array<int> changedDefaults;
+    std::vector<float> savedDefaults;
+    for(int i = 0; i < paramCount; i++) {
+        ids.add(stream.readString());
+        if(stateVersion < 4) continue;
+        float value = stream.readFloat();
+        savedDefaults.push_back(value);
+        if(std::isnan(value) || !_paramIndex.contains(ids[i])) continue;
+        if(value != _params[(size_t)_paramIndex[ids[i]]].defaultValue) changedDefaults.add(i);
+    }
+    auto addParam = [&ids](juce::ValueTree &vtsState, int index, float value) {
+        juce::ValueTree child(ParamIdentifier);
+        child.setProperty(IDIdentifier, ids[index], nullptr);
+        child.setProperty(ValueIdentifier, value, nullptr);
+        vtsState.appendChild(child, nullptr);
+    };
+    if(stateVersion == 2 && stream.getNumBytesRemaining() < (juce::int64)paramCount * programCount * (juce::int64)sizeof(float)) {
+        juce::Logger::writeToLog("State binary is too short for the param values");
+        return false;
+    }
+    for(int i = 0; i < programCount; i++) {
+        juce::ValueTree vtsState(vtsType);
+        if(stateVersion == 2) {
+            for(int j = 0; j < paramCount; j++) {
+                float value = stream.readFloat();
+                if(!std::isnan(value)) addParam(vtsState, j, value);
+            }
+        } else {
+            int count = stream.readCompressedInt();
+            if(count < 0 || count > paramCount) {
+                juce::Logger::writeToLog("State binary has an invalid param count for program " + juce::String(i));
+                return false;
+            }
+            for(int j = 0; j < count; j++) {
+                if(stream.isExhausted()) {
+                    juce::Logger::writeToLog("State binary is too short for the param values");
+                    return false;
+                }
+                int index = stream.readCompressedInt();
+                float value = stream.readFloat();
+                if(index < 0 || index >= paramCount) {
+                    juce::Logger::writeToLog("State binary has a bad param in program " + juce::String(i));
+                    return false;
+                }
+                addParam(vtsState, index, value);
+            }
+            for(int index : changedDefaults) {
+                if(!vtsState.getChildWithProperty(IDIdentifier, ids[index]).isValid()) {
+                    addParam(vtsState, index, savedDefaults[(size_t)index]);
+                }
+            }
+        }
+        vtsStateArray.add(vtsState);
+    }
+    return loadState(appState, programStateArray, vtsStateArray, currentProgram);
+}
+
+void ProgramManager::parameterValueChanged(int parameterIndex, float newValue) {
+    juce::ignoreUnused(newValue);
+    if(parameterIndex < 0 || (size_t)parameterIndex >= _params.size()) return;
+    _dirty[(size_t)parameterIndex / 64].fetch_or((uint64_t)1 << (parameterIndex % 64), std::memory_order_release);
+    return;
+}
+
+void ProgramManager::parameterGestureChanged(int parameterIndex, bool gestureIsStarting) {
+    juce::ignoreUnused(parameterIndex, gestureIsStarting);
+    return;
+}
+
 void ProgramManager::actionListenerCallback(const juce::String &message) {
     juce::StringArray tokens = juce::StringArray::fromTokens(message, false);
     if(tokens.size() < 2) return;
@@ -2,11 +2,17 @@
 #define _PROGRAMMANAGER_H_
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
 #include <juce_data_structures/juce_data_structures.h>
 #include <juce_audio_processors/juce_audio_processors.h>
 
 class ProgramManager : 
-    public juce::ActionListener
+    public juce::ActionListener,
+    private juce::AudioProcessorParameter::Listener
 {
     public:
         typedef std::unique_ptr<juce::XmlElement> StateXML;
@@ -26,6 +32,24 @@ class ProgramManager :
                 }
         };
         typedef juce::Array<PresetInfo> PresetInfoArray;
+
+        // The engine state for a program, built ahead of time so the engine
+        // can switch to the program at once and the parameters can be loaded
+        // afterwards.  Whoever owns the engine builds them, and they never
+        // change once they're built.  They're built on a worker thread the
+        // first time they're asked for, and only the last few used are kept.
+        class Snapshot {
+            public:
+                virtual ~Snapshot() { };
+                // False once the engine can't play it any more, say because the
+                // time signature has changed.  It gets built again.
+                virtual bool isCurrent() const {
+                    return true;
+                }
+        };
+        typedef std::shared_ptr<const Snapshot> SnapshotPtr;
+        typedef std::function<SnapshotPtr(const juce::ValueTree &vtsState)> SnapshotBuilder;
+
         class Listener {
             public:
                 virtual ~Listener() { };
@@ -33,15 +57,26 @@ class ProgramManager :
                     juce::ignoreUnused(value);
                 };
                 virtual void programManagerCurrentProgramNamedChanged() { };
+                // Called either side of replacing all the parameter values.
+                // The snapshot is of the program being loaded, if there is one.
+                virtual void programManagerStateWillLoad(const SnapshotPtr &snapshot) {
+                    juce::ignoreUnused(snapshot);
+                };
+                virtual void programManagerStateLoaded() { };
                 virtual void programManagerListChanged() { };
         };
 
+        // Snapshots kept, for the programs most recently asked for.
+        static constexpr int snapshotCacheSize = 4;
+
         static juce::File userStateStoragePath();
         static PresetInfoArray getPresetsInFolder(const juce::File &path);
 
         ProgramManager(const juce::String &appName, juce::AudioProcessorValueTreeState &vts, juce::UndoManager *undo);
         ~ProgramManager();
 
+        // Must be called before init().
+        void setSnapshotBuilder(SnapshotBuilder builder);
         void init();
         
         // Acces to the app state tree.  This is a single tree that persists
@@ -57,19 +92,41 @@ class ProgramManager :
         int currentProgram() const;
         int programCount() const;
         void changeProgram(int index);
+        // The snapshot to switch the engine to the program with, if it's ready.
+        // Never waits.  If it isn't built yet it gets built in the background
+        // and this returns nullptr, so a program change just loads the
+        // parameters.
+        SnapshotPtr snapshot(int index);
+        // Starts building the snapshot in the background if it isn't there,
+        // so it's ready by the time the program's needed.
+        void prepareSnapshot(int index);
         void renameProgram(int index, const juce::String &name);
         void duplicateProgram(int indexToCopy);
         void deleteProgram(int indexToDelete);
         void overwriteProgram(int indexToCopy, int indexToOverwrite);
         juce::String programName(int index) const;
+        // Unique ID of the program, which stays with it when others are deleted.
+        juce::String programID(int index) const;
+        // Index of the program with the ID, or -1 if there isn't one.
+        int findProgram(const juce::String &id) const;
 
+        // XML state, for presets.
         StateXML getStateXML();
         bool setStateFromXML(const StateXML &xml);
+        // Binary state, for the host.  The parameter IDs are written once and
+        // each program's values are packed floats, so it's much smaller and
+        // quicker than the XML.  isStateBinary() tells it from XML saved with
+        // copyXmlToBinary() by older versions.
+        void getStateBinary(juce::MemoryBlock &dest);
+        bool setStateFromBinary(const void *data, size_t size);
+        static bool isStateBinary(const void *data, size_t size);
 
         void addListener(Listener *listener);
         void removeListener(Listener *listener);
 
     private:
+        typedef std::shared_future<SnapshotPtr> SnapshotFuture;
+
         int                                 _currentProgram = 0;
         juce::UndoManager                   *_undo = nullptr;
         juce::String                        _appName;
@@ -77,18 +134,66 @@ class ProgramManager :
         juce::ValueTree                     _programState;
         juce::ValueTree                     _appState;
         juce::Array<juce::ValueTree>        _programStateArray;
+        // Only the parameters that differ from their defaults.  The current
+        // program's full state is in the parameters themselves.  They're
+        // never changed once they're stored, only replaced, so programs can
+        // share them.
         juce::Array<juce::ValueTree>        _vtsStateArray;
+        // Snapshots by the delta they were built from.  A delta is replaced
+        // when its program is edited, so nothing finds a snapshot that's out
+        // of date, and programs that share a delta share its snapshot.
+        struct CachedSnapshot {
+            juce::ValueTree             delta;
+            SnapshotFuture              snapshot;
+        };
+        juce::Array<CachedSnapshot>         _snapshotCache;     // Most recently used first
+        juce::Array<SnapshotFuture>         _building;          // Snapshots being built in the background
+        // Shared by every instance, and torn down with the last one rather
+        // than at static destruction, which in a plugin is after JUCE has
+        // shut down.  Snapshots are only built when programs change, so a
+        // couple of threads is plenty.
+        struct SnapshotPool {
+            juce::ThreadPool        pool { juce::jlimit(1, 2, juce::SystemStats::getNumCpus() - 1) };
+        };
+        juce::SharedResourcePointer<SnapshotPool> _snapshotPool;
+        // A parameter, by its index in the processor.
+        struct Param {
+            juce::String            id;
+            float                   defaultValue = 0.0f;
+            std::atomic<float>      *value = nullptr;   // Raw value, from the value tree state
+            float                   synced = 0.0f;      // Value in the current program's stored delta
+        };
+        std::vector<Param>                  _params;
+        juce::HashMap<juce::String, int>    _paramIndex;        // ID to index in _params
+        // A bit for each parameter changed since the last sync.  Set from
+        // whatever thread changes it.
+        std::vector<std::atomic<uint64_t>>  _dirty;
+        SnapshotBuilder                     _snapshotBuilder;
         juce::ListenerList<Listener>        _listenerList; 
 
         bool setStateFromXMLv1(const StateXML &xml);
+        bool setStateFromBinaryV2(juce::InputStream &stream, int stateVersion);
+        bool loadState(const juce::ValueTree &appState, const juce::Array<juce::ValueTree> &programStateArray,
+            const juce::Array<juce::ValueTree> &vtsStateArray, int currentProgram);
 
         juce::ValueTree &programStateForIndex(int index);
         const juce::ValueTree &programStateForIndex(int index) const;
 
         void syncToArray();
-        void syncFromArray();
+        void syncFromArray(bool notify = true);
+        // Converts between a full parameter state, as made by copyState(), and
+        // the delta against the defaults that's stored.  Deltas only mean
+        // anything against the defaults of this build, so the host chunk
+        // saves the defaults with them and presets get the full state.
+        juce::ValueTree deltaState(const juce::ValueTree &vtsState) const;
+        juce::ValueTree fullState(const juce::ValueTree &delta) const;
+        // On a worker thread.  The state mustn't be shared with the
+        // parameters, as they change it.
+        SnapshotFuture buildSnapshot(const juce::ValueTree &vtsState);
 
         void actionListenerCallback(const juce::String &message);
+        void parameterValueChanged(int parameterIndex, float newValue) override;
+        void parameterGestureChanged(int parameterIndex, bool gestureIsStarting) override;
 };
 
 inline juce::ValueTree &ProgramManager::appState() {
@@ -0,0 +1,61 @@
+#ifndef _RINGBUFFER_H_
+#define _RINGBUFFER_H_
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+// Lock free, single writer / single reader ring buffer with a fixed capacity.
+//
+// The capacity is set in the constructor, after that neither side ever blocks
+// or allocates, so it's safe to use either side from the audio thread.
+template <typename T>
+class RingBuffer {
+    public:
+        RingBuffer(int capacity) :
+            _buffer((size_t)capacity + 1)
+        { }
+
+        int capacity() const {
+            return (int)_buffer.size() - 1;
+        }
+
+        // Writer side
+        int space() const {
+            size_t head = _head.load(std::memory_order_relaxed);
+            size_t tail = _tail.load(std::memory_order_acquire);
+            return (int)((tail + _buffer.size() - head - 1) % _buffer.size());
+        }
+
+        bool push(const T &item) {
+            size_t head = _head.load(std::memory_order_relaxed);
+            size_t next = (head + 1) % _buffer.size();
+            if(next == _tail.load(std::memory_order_acquire)) return false;
+            _buffer[head] = item;
+            _head.store(next, std::memory_order_release);
+            return true;
+        }
+
+        // Reader side.  Returns nullptr if the ring is empty.
+        const T *peek() const {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if(tail == _head.load(std::memory_order_acquire)) return nullptr;
+            return &_buffer[tail];
+        }
+
+        void pop() {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            _tail.store((tail + 1) % _buffer.size(), std::memory_order_release);
+            return;
+        }
+
+    private:
+        std::vector<T>          _buffer;
+        std::atomic<size_t>     _head { 0 };    // Next slot to write, owned by the writer
+        std::atomic<size_t>     _tail { 0 };    // Next slot to read, owned by the reader
+
+        RingBuffer(const RingBuffer &) = delete;
+        RingBuffer &operator=(const RingBuffer &) = delete;
+};
+
+#endif
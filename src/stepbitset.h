@@ -0,0 +1,103 @@
+#ifndef _STEPBITSET_H_
+#define _STEPBITSET_H_
+#pragma once
+
+#include <cstdint>
+
+// Fixed capacity, word packed set of step bits.  Each step of a beat
+// pattern is a single bit, so the logic operations used to build a
+// pattern run a whole word (64 steps) at a time.  Only the words that are
+// needed for the requested number of steps are ever touched and the loops
+// are kept simple so the compiler can vectorize them.
+template <int Capacity>
+class StepBitset {
+    public:
+        typedef uint64_t Word;
+
+        static constexpr int bitsPerWord = 64;
+        static constexpr int capacity = Capacity;
+        static constexpr int wordCapacity = (Capacity + bitsPerWord - 1) / bitsPerWord;
+
+        // Returns the number of words needed to hold the given number of steps.
+        static constexpr int wordCount(int steps) {
+            return (steps + bitsPerWord - 1) / bitsPerWord;
+        }
+
+        // Clears all the bits needed to hold the given number of steps.
+        void clear(int steps) {
+            const int count = wordCount(steps);
+            for(int i = 0; i < count; i++) _words[i] = 0;
+            return;
+        }
+
+        // Sets all the bits from 0 .. steps - 1
+        void fill(int steps) {
+            const int count = wordCount(steps);
+            for(int i = 0; i < count; i++) _words[i] = ~(Word)0;
+            maskTail(steps);
+            return;
+        }
+
+        // Clears any bits in the last word that are past the given number of steps.
+        // Needed after any operation that may have inverted the unused bits.
+        void maskTail(int steps) {
+            const int tail = steps % bitsPerWord;
+            if(tail) _words[steps / bitsPerWord] &= ((Word)1 << tail) - 1;
+            return;
+        }
+
+        void set(int step) {
+            _words[step / bitsPerWord] |= (Word)1 << (step % bitsPerWord);
+            return;
+        }
+
+        bool test(int step) const {
+            return (_words[step / bitsPerWord] >> (step % bitsPerWord)) & 1;
+        }
+
+        // Sets this to src rotated towards the higher steps by amount, wrapping
+        // around at steps.  src must have no bits set past steps.
+        void rotate(const Word *src, int steps, int amount) {
+            const int count = wordCount(steps);
+            clear(steps);
+            orShiftedUp(src, count, amount);
+            if(amount) orShiftedDown(src, count, steps - amount);
+            maskTail(steps);
+            return;
+        }
+
+        Word *words() {
+            return _words;
+        }
+
+        const Word *words() const {
+            return _words;
+        }
+
+    private:
+        Word    _words[(size_t)wordCapacity];
+
+        void orShiftedUp(const Word *src, int count, int shift) {
+            const int wordShift = shift / bitsPerWord;
+            const int bitShift = shift % bitsPerWord;
+            for(int i = count - 1; i >= wordShift; i--) {
+                Word w = src[i - wordShift] << bitShift;
+                if(bitShift && i - wordShift - 1 >= 0) w |= src[i - wordShift - 1] >> (bitsPerWord - bitShift);
+                _words[i] |= w;
+            }
+            return;
+        }
+
+        void orShiftedDown(const Word *src, int count, int shift) {
+            const int wordShift = shift / bitsPerWord;
+            const int bitShift = shift % bitsPerWord;
+            for(int i = 0; i + wordShift < count; i++) {
+                Word w = src[i + wordShift] >> bitShift;
+                if(bitShift && i + wordShift + 1 < count) w |= src[i + wordShift + 1] << (bitsPerWord - bitShift);
+                _words[i] |= w;
+            }
+            return;
+        }
+};
+
+#endif
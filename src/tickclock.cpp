@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cmath>
+#include "tickclock.h"
+
+// Tempo is quantized to this many steps per BPM so the rate can be kept as an
+// exact integer ratio.
+static const int64_t bpmScale = 1000;
+
+TickClock::Tick TickClock::quarterNotesToTicks(double qn) {
+    return (Tick)std::llround(qn * (double)ticksPerQuarterNote);
+}
+
+double TickClock::ticksToQuarterNotes(Tick tick) {
+    return (double)tick / (double)ticksPerQuarterNote;
+}
+
+TickClock::Tick TickClock::barLength(int numerator, int denominator) {
+    if(numerator < 1 || denominator < 1) return defaultBarLength;
+    // Exact for any denominator that divides a whole note, which covers
+    // every power of two a host will give us.
+    Tick ret = ticksPerWholeNote * numerator / denominator;
+    return std::max(ret, minBarLength);
+}
+
+TickClock::TickClock() {
+
+}
+
+void TickClock::setRate(double bpm, double sampleRate) {
+    int64_t numerator = std::llround(bpm * (double)bpmScale) * ticksPerQuarterNote;
+    int64_t denominator = std::llround(sampleRate) * 60 * bpmScale;
+    if(numerator < 1) numerator = 1;
+    if(denominator < 1) denominator = 1;
+    if(numerator == _numerator && denominator == _denominator) return;
+    // Keep the same fractional position in terms of the new denominator.
+    _remainder = (int64_t)((double)_remainder / (double)_denominator * (double)denominator);
+    if(_remainder >= denominator) _remainder = denominator - 1;
+    _numerator = numerator;
+    _denominator = denominator;
+    return;
+}
+
+void TickClock::setPosition(Tick tick) {
+    _tick = tick;
+    _remainder = 0;
+    return;
+}
+
+bool TickClock::sync(Tick tick) {
+    Tick tolerance = _numerator / _denominator + 1;
+    Tick diff = tick - _tick;
+    if(diff <= tolerance && diff >= -tolerance) return false;
+    setPosition(tick);
+    return true;
+}
+
+TickClock::Block TickClock::advance(int samples) {
+    Block ret;
+    ret.origin = _tick;
+    ret.remainder = _remainder;
+    ret.numerator = _numerator;
+    ret.denominator = _denominator;
+    ret.samples = samples;
+    // A tick belongs to the block if it's at or after the exact block start,
+    // so skip the current tick if we're already part way past it.
+    ret.start = _remainder > 0 ? _tick + 1 : _tick;
+
+    int64_t acc = _remainder + (int64_t)samples * _numerator;
+    _tick += acc / _denominator;
+    _remainder = acc % _denominator;
+
+    ret.end = _remainder > 0 ? _tick + 1 : _tick;
+    return ret;
+}
+
+int TickClock::samplesUntil(Tick tick, int maxSamples) const {
+    if(tick <= _tick) return 0;
+    // Anything further away than maxSamples could cover is capped before the
+    // multiply, so it can't overflow.
+    Tick reach = (Tick)maxSamples * _numerator / _denominator + 1;
+    if(tick - _tick > reach) return maxSamples;
+    int64_t samples = ((tick - _tick) * _denominator - _remainder) / _numerator;
+    return (int)std::min<int64_t>(samples, maxSamples);
+}
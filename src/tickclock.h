@@ -0,0 +1,93 @@
+#ifndef _TICKCLOCK_H_
+#define _TICKCLOCK_H_
+#pragma once
+
+#include <cstdint>
+
+// Integer musical time line for the engine.
+//
+// Musical time is counted in ticks on a fixed, high resolution grid.  The
+// clock tracks the exact sample position as a whole number of ticks plus a
+// remainder (in units of 1 / denominator ticks), so advancing it by any
+// number of samples is exact and it never drifts no matter how long it runs.
+class TickClock {
+    public:
+        typedef int64_t Tick;
+
+        // 720720 is the smallest number divisible by everything from 1 .. 16,
+        // so most musically useful step counts land exactly on the grid.
+        static constexpr Tick ticksPerQuarterNote = 720720;
+        static constexpr Tick ticksPerWholeNote = ticksPerQuarterNote * 4;
+        // Length of a bar in 4/4, for when there's no time signature.
+        static constexpr Tick defaultBarLength = ticksPerWholeNote;
+        // Shorter bars are played at this length.  The worst case event
+        // counts are worked out from it.
+        static constexpr Tick minBarLength = ticksPerWholeNote / 16;
+
+        // The window of ticks covered by a block of samples, and the information
+        // needed to map a tick in that window back to a sample offset.
+        struct Block {
+            Tick    start = 0;          // First whole tick in the block
+            Tick    end = 0;            // First whole tick after the block
+            Tick    origin = 0;         // Whole tick part of the block start position
+            int64_t remainder = 0;      // Fractional part of the block start position
+            int64_t numerator = 0;      // Ticks per sample is numerator / denominator
+            int64_t denominator = 1;
+            int     samples = 0;
+
+            // Returns the offset of the sample the tick falls in.  The tick must be in the block.
+            int sampleOffset(Tick tick) const {
+                return (int)(((tick - origin) * denominator - remainder) / numerator);
+            }
+        };
+
+        static Tick quarterNotesToTicks(double qn);
+        static double ticksToQuarterNotes(Tick tick);
+        // Length of a bar in the time signature.  Anything that isn't a
+        // time signature gets the default.
+        static Tick barLength(int numerator, int denominator);
+
+        // Floor division and modulo that do the right thing with negative ticks
+        // (some hosts start the transport before zero for pre-roll).
+        static Tick floorDiv(Tick value, Tick divisor);
+        static Tick floorMod(Tick value, Tick divisor);
+
+        TickClock();
+
+        void setRate(double bpm, double sampleRate);
+        void setPosition(Tick tick);
+        // Moves the clock to the given position only if it's further away than
+        // a sample from where the clock thinks it is.  Used to follow the host.
+        // Returns true if the clock jumped.
+        bool sync(Tick tick);
+
+        Tick position() const;
+        // Number of samples before the one the tick falls in, so advancing by
+        // that many starts the next block on it.  Never more than maxSamples,
+        // and 0 if the tick has already been reached.
+        int samplesUntil(Tick tick, int maxSamples) const;
+        // Returns the window covering the next given number of samples and moves the clock past it.
+        Block advance(int samples);
+
+    private:
+        Tick        _tick = 0;
+        int64_t     _remainder = 0;
+        int64_t     _numerator = 0;
+        int64_t     _denominator = 1;
+};
+
+inline TickClock::Tick TickClock::floorDiv(Tick value, Tick divisor) {
+    Tick ret = value / divisor;
+    if((value % divisor != 0) && ((value < 0) != (divisor < 0))) ret--;
+    return ret;
+}
+
+inline TickClock::Tick TickClock::floorMod(Tick value, Tick divisor) {
+    return value - floorDiv(value, divisor) * divisor;
+}
+
+inline TickClock::Tick TickClock::position() const {
+    return _tick;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _TRIPLEBUFFER_H_
+#define _TRIPLEBUFFER_H_
+#pragma once
+
+#include <atomic>
+
+// Lock free, single writer / single reader triple buffer.
+//
+// The writer fills back() and calls publish() to hand it over.  The reader
+// calls update() to pick up the most recently published buffer and then
+// reads front().  Neither side ever blocks or allocates, so it's safe to use
+// the reader side from the audio thread.  If the writer publishes more than
+// once before the reader gets to it, the reader only ever sees the newest.
+template <typename T>
+class TripleBuffer {
+    public:
+        TripleBuffer() { }
+
+        // Writer side
+        T &back() {
+            return _buffers[_back];
+        }
+
+        void publish() {
+            int prev = _middle.exchange(_back | dirtyFlag, std::memory_order_acq_rel);
+            _back = prev & indexMask;
+            return;
+        }
+
+        // Reader side.  Returns true if a newly published buffer was picked up.
+        bool update() {
+            if((_middle.load(std::memory_order_relaxed) & dirtyFlag) == 0) return false;
+            int prev = _middle.exchange(_front, std::memory_order_acq_rel);
+            _front = prev & indexMask;
+            return true;
+        }
+
+        const T &front() const {
+            return _buffers[_front];
+        }
+
+    private:
+        static constexpr int indexMask = 0x03;
+        static constexpr int dirtyFlag = 0x04;
+
+        T                   _buffers[3];
+        int                 _front = 0;     // Owned by the reader
+        int                 _back = 2;      // Owned by the writer
+        std::atomic<int>    _middle { 1 };  // Index of the hand off buffer plus the dirty flag
+
+        TripleBuffer(const TripleBuffer &) = delete;
+        TripleBuffer &operator=(const TripleBuffer &) = delete;
+};
+
+#endif